@@ -1,18 +1,18 @@
 use std::env;
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
 
 fn main() {
-    // Tell cargo to look for shared libraries in the specified directory
-    println!(
-        "cargo:rustc-link-search={}",
-        env::var("FAUST_LIB_PATH").expect("env var FAUST_LIB_PATH not found")
-    );
-
-    // Tell cargo to tell rustc to statically link with libfaust and llvm
-    println!(
-        "cargo:rustc-link-lib={}",
-        env::var("FAUST_LIB").expect("env var FAUST_LIB not found")
-    );
+    let faust_lib_path = env::var("FAUST_LIB_PATH").expect("env var FAUST_LIB_PATH not found");
+    let faust_lib = env::var("FAUST_LIB").expect("env var FAUST_LIB not found");
+    let lazy_engine = cfg!(feature = "lazy_engine");
+
+    if !lazy_engine {
+        // Tell cargo to look for shared libraries in the specified directory
+        println!("cargo:rustc-link-search={}", faust_lib_path);
+
+        // Tell cargo to tell rustc to statically link with libfaust and llvm
+        println!("cargo:rustc-link-lib={}", faust_lib);
+    }
 
     // Tell cargo to invalidate the built crate whenever the wrapper changes
     for c_file in glob::glob("c_src/**/*").unwrap() {
@@ -27,7 +27,7 @@ fn main() {
 
     // The bindgen::Builder is the main entry point to bindgen, and lets you
     // build up options for the resulting bindings.
-    let bindings = bindgen::Builder::default()
+    let mut bindings_builder = bindgen::Builder::default()
         // The input header we would like to generate
         // bindings for.
         .header("c_src/wrapper.hpp")
@@ -36,7 +36,15 @@ fn main() {
         // included header files changed.
         .rustified_enum("WWidgetDeclType")
         .rustified_enum("WMidiSyncMsg")
-        .parse_callbacks(Box::new(bindgen::CargoCallbacks::new()))
+        .parse_callbacks(Box::new(bindgen::CargoCallbacks::new()));
+    if lazy_engine {
+        // The wrapper functions become methods of a struct that holds the
+        // dlopen'd engine (see wrapper.rs)
+        bindings_builder = bindings_builder
+            .dynamic_library_name("FaustJitEngine")
+            .dynamic_link_require_all(true);
+    }
+    let bindings = bindings_builder
         // Finish the builder and generate the bindings.
         .generate()
         // Unwrap the Result and panic on failure.
@@ -55,5 +63,59 @@ fn main() {
         .file("c_src/wrapper.cpp");
     #[cfg(feature = "define_faust_static_vars")]
     cc.define("DEFINE_FAUST_STATIC_VARS", "");
-    cc.compile("wrapper-lib");
+
+    if lazy_engine {
+        let engine_path = link_engine(&mut cc, &out_path, &faust_lib_path, &faust_lib);
+        // Where the engine is looked for when it is not found next to the
+        // binary (see wrapper.rs):
+        println!(
+            "cargo:rustc-env=FAUST_JIT_ENGINE_PATH={}",
+            engine_path.display()
+        );
+        println!(
+            "cargo:rustc-env=FAUST_JIT_ENGINE_NAME={}",
+            engine_path.file_name().unwrap().to_str().unwrap()
+        );
+        println!("cargo:rerun-if-env-changed=FAUST_ENGINE_LINK_ARGS");
+    } else {
+        cc.compile("wrapper-lib");
+    }
+}
+
+/// Builds the wrapper and libfaust (+ llvm) as a standalone shared object, that
+/// faust_jit will dlopen only when the first DSP has to be created
+fn link_engine(cc: &mut cc::Build, out_path: &Path, faust_lib_path: &str, faust_lib: &str) -> PathBuf {
+    let target_os = env::var("CARGO_CFG_TARGET_OS").unwrap();
+    let (shared_flag, engine_name) = match target_os.as_str() {
+        "linux" => ("-shared", "libfaust_jit_engine.so"),
+        "macos" => ("-dynamiclib", "libfaust_jit_engine.dylib"),
+        os => panic!("The lazy_engine feature is not supported on {}", os),
+    };
+    let engine_path = out_path.join(engine_name);
+
+    let objects = cc.pic(true).compile_intermediates();
+    let mut cmd = cc.get_compiler().to_command();
+    cmd.arg(shared_flag).args(&objects).arg("-o").arg(&engine_path);
+
+    // FAUST_LIB follows the rustc-link-lib syntax, ie. "[KIND=]NAME"
+    let (kind, name) = faust_lib.split_once('=').unwrap_or(("dylib", faust_lib));
+    if kind == "static" {
+        let file_name = if name.starts_with("lib") {
+            format!("{}.a", name)
+        } else {
+            format!("lib{}.a", name)
+        };
+        cmd.arg(Path::new(faust_lib_path).join(file_name));
+    } else {
+        cmd.arg(format!("-L{}", faust_lib_path))
+            .arg(format!("-l{}", name));
+    }
+    // Statically linked llvm may need extra system libraries (zlib, tinfo...)
+    if let Ok(extra_args) = env::var("FAUST_ENGINE_LINK_ARGS") {
+        cmd.args(extra_args.split_whitespace());
+    }
+
+    let status = cmd.status().expect("Couldn't run the linker for the faust engine");
+    assert!(status.success(), "Linking the faust engine failed: {:?}", cmd);
+    engine_path
 }
@@ -8,11 +8,27 @@
 #include <iostream>
 #include <faust/dsp/poly-llvm-dsp.h>
 
-#include <faust/dsp/timed-dsp.h>
-
 #include <faust/midi/midi.h>
 #include <faust/gui/MidiUI.h>
 
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <sstream>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
 #ifdef DEFINE_FAUST_STATIC_VARS
 // These static vars must be declared in the application code. See
 // https://faustdoc.grame.fr/manual/architectures/#multi-controller-and-synchronization
@@ -20,39 +36,367 @@ std::list<GUI *> GUI::fGuiList;
 ztimedmap GUI::gTimedZoneMap;
 #endif
 
-WFactory *w_createDSPFactoryFromFile(const char *filepath, const int argc, const char *argv[], char *err_msg_c)
+// Allocates each block with its own anonymous mapping. The OS hands out such
+// pages zeroed, and only makes them resident on first access, unless `mode`
+// asks to do it right away
+class w_memory_manager : public dsp_memory_manager
 {
+private:
+    WDspMemory fMode;
+    // Room before each block to remember the size of its mapping. Keeps the
+    // block aligned enough for any SIMD type
+    static const size_t kHeaderSize = 64;
+    // The smallest page size of the supported platforms. Touching a byte
+    // every that many makes every page resident
+    static const size_t kPageSize = 4096;
+
+public:
+    w_memory_manager(WDspMemory mode) : fMode(mode) {}
+
+    void *allocate(size_t size) override
+    {
+        size_t total = size + kHeaderSize;
+#ifdef _WIN32
+        void *base = VirtualAlloc(nullptr, total, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (!base)
+            return nullptr;
+        // Failing to lock (e.g. because of quotas) just leaves the memory pageable
+        if (fMode == MEMORY_LOCKED)
+            VirtualLock(base, total);
+#else
+        void *base = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return nullptr;
+        if (fMode == MEMORY_LOCKED)
+            mlock(base, total);
+#endif
+        // Page faults are taken here, on the thread creating the instance,
+        // instead of on the one that computes it
+        if (fMode != MEMORY_LAZY)
+            for (size_t offset = 0; offset < total; offset += kPageSize)
+                static_cast<volatile char *>(base)[offset] = 0;
+        *static_cast<size_t *>(base) = total;
+        return static_cast<char *>(base) + kHeaderSize;
+    }
+
+    void destroy(void *ptr) override
+    {
+        if (!ptr)
+            return;
+        char *base = static_cast<char *>(ptr) - kHeaderSize;
+#ifdef _WIN32
+        VirtualFree(base, 0, MEM_RELEASE);
+#else
+        munmap(base, *reinterpret_cast<size_t *>(base));
+#endif
+    }
+};
+
+// Factories only keep a pointer to their memory manager, which must thus
+// outlive them
+static w_memory_manager gLazyMemory(MEMORY_LAZY);
+static w_memory_manager gPrefaultedMemory(MEMORY_PREFAULTED);
+static w_memory_manager gLockedMemory(MEMORY_LOCKED);
+
+static w_memory_manager *memoryManager(WDspMemory memory)
+{
+    switch (memory)
+    {
+    case MEMORY_PREFAULTED:
+        return &gPrefaultedMemory;
+    case MEMORY_LOCKED:
+        return &gLockedMemory;
+    default:
+        return &gLazyMemory;
+    }
+}
+
+// The memory manager is a setting of the factory, which instances of different
+// memory kinds may be created from at once
+static std::mutex gMemoryMutex;
+
+// For each factory, the sample rate classInit was last run with, and how many
+// WFactory use it. The tables classInit fills (e.g. for rdtable) are shared by
+// all the instances of a factory, so it only needs to run again when the
+// sample rate changes. libfaust gives the same factory to all the WFactory
+// created from the same code, and only frees it with the last of them.
+//
+// Only the WFactory created here (compiled or read from a cache) hold a
+// reference, as only they are sure to be deleted with w_deleteDSPFactory.
+// Factories given by someone else may be freed behind our back, and another
+// one allocated at the same address, so classInit always runs for them
+// (unless they share their code with one of ours)
+struct ClassInitState
+{
+    int fSampleRate = 0;
+    int fRefs = 0;
+};
+static std::mutex gClassInitMutex;
+static std::map<dsp_factory *, ClassInitState> gClassInitStates;
+static std::set<WFactory *> gClassInitHolders;
+
+// Fills the tables shared by all the instances of a factory (classInit). The
+// only way to do it through the dsp interface is init(), so it is done on a
+// throwaway instance
+static void classInit(dsp_factory *factory, int sample_rate)
+{
+    std::lock_guard<std::mutex> lock(gClassInitMutex);
+    auto it = gClassInitStates.find(factory);
+    if (it != gClassInitStates.end() && it->second.fSampleRate == sample_rate)
+        return;
+    dsp *class_dsp = factory->createDSPInstance();
+    class_dsp->init(sample_rate);
+    delete class_dsp;
+    if (it != gClassInitStates.end())
+        it->second.fSampleRate = sample_rate;
+}
+
+// Called once for each WFactory created here
+static void retainClassInit(WFactory *factory)
+{
+    std::lock_guard<std::mutex> lock(gClassInitMutex);
+    if (!gClassInitHolders.insert(factory).second)
+        return;
+    for (dsp_factory *f : {factory->fProcessFactory, factory->fEffectFactory})
+        if (f)
+            gClassInitStates[f].fRefs++;
+}
+
+// Does nothing for the WFactory that don't hold a reference
+static void releaseClassInit(WFactory *factory)
+{
+    std::lock_guard<std::mutex> lock(gClassInitMutex);
+    if (gClassInitHolders.erase(factory) == 0)
+        return;
+    for (dsp_factory *f : {factory->fProcessFactory, factory->fEffectFactory})
+    {
+        if (!f)
+            continue;
+        auto it = gClassInitStates.find(f);
+        if (--it->second.fRefs == 0)
+            gClassInitStates.erase(it);
+    }
+}
+
+// Guards GUI::fGuiList and GUI::gTimedZoneMap, which are shared by all the
+// instances of the process. They are only modified when UIs and timed zones
+// are created or deleted, which the audio threads never do. These only read
+// the map (to write dated values from MIDI), so they never wait for long
+static std::shared_timed_mutex gGuiGlobalsMutex;
+
+// Sample-accurate control, like timed_dsp (see
+// https://faustdoc.grame.fr/manual/architectures/#sample-accurate-control).
+// timed_dsp applies the dated values of all the zones in GUI::gTimedZoneMap,
+// which holds those of every instance of the process: computing an instance
+// would also consume the values meant for the others, from the wrong thread.
+// This one only knows about the timed zones of its own DSP
+class w_timed_dsp : public decorator_dsp
+{
+private:
+    // The timed zones of the DSP, with the ringbuffer of their dated values
+    std::vector<std::pair<FAUSTFLOAT *, ringbuffer_t *>> fTimedZones;
+    // The channels, starting at the current slice of the block
+    std::vector<FAUSTFLOAT *> fInputs, fOutputs;
+
+public:
+    // Whether the memory of the DSP comes from a w_memory_manager
+    bool fMappedMemory;
+
+    w_timed_dsp(dsp *dsp, bool mapped_memory)
+        : decorator_dsp(dsp), fInputs(dsp->getNumInputs()), fOutputs(dsp->getNumOutputs()), fMappedMemory(mapped_memory)
+    {
+    }
+
+    w_timed_dsp *clone() override
+    {
+        return new w_timed_dsp(fDSP->clone(), fMappedMemory);
+    }
+
+    void addTimedZone(FAUSTFLOAT *zone, ringbuffer_t *ringbuffer)
+    {
+        if (!timedZone(zone))
+            fTimedZones.push_back({zone, ringbuffer});
+    }
+
+    void removeTimedZone(FAUSTFLOAT *zone)
+    {
+        for (auto it = fTimedZones.begin(); it != fTimedZones.end(); ++it)
+        {
+            if (it->first == zone)
+            {
+                fTimedZones.erase(it);
+                return;
+            }
+        }
+    }
+
+    ringbuffer_t *timedZone(FAUSTFLOAT *zone)
+    {
+        for (auto &timed_zone : fTimedZones)
+            if (timed_zone.first == zone)
+                return timed_zone.second;
+        return nullptr;
+    }
+
+    // The dates of the values are sample offsets in the block, so `date_usec`
+    // is ignored. The block is computed in slices, at the start of which the
+    // values dated within them are written to their zones
+    void compute(double date_usec, int count, FAUSTFLOAT **inputs, FAUSTFLOAT **outputs) override
+    {
+        int offset = 0;
+        while (offset < count)
+        {
+            int next = count;
+            for (auto &timed_zone : fTimedZones)
+            {
+                DatedControl control;
+                while (ringbuffer_peek(timed_zone.second, (char *)&control, sizeof(DatedControl)) == sizeof(DatedControl))
+                {
+                    // Values dated after the block are applied on its last sample
+                    int date = std::min((int)control.fDate, count - 1);
+                    if (date > offset)
+                    {
+                        next = std::min(next, date);
+                        break;
+                    }
+                    *timed_zone.first = control.fValue;
+                    ringbuffer_read_advance(timed_zone.second, sizeof(DatedControl));
+                }
+            }
+            for (size_t i = 0; i < fInputs.size(); i++)
+                fInputs[i] = inputs[i] + offset;
+            for (size_t i = 0; i < fOutputs.size(); i++)
+                fOutputs[i] = outputs[i] + offset;
+            fDSP->compute(next - offset, fInputs.data(), fOutputs.data());
+            offset = next;
+        }
+    }
+
+    void compute(int count, FAUSTFLOAT **inputs, FAUSTFLOAT **outputs) override
+    {
+        compute(-1, count, inputs, outputs);
+    }
+
+    void computeDirect(int count, FAUSTFLOAT **inputs, FAUSTFLOAT **outputs)
+    {
+        fDSP->compute(count, inputs, outputs);
+    }
+
+    // For a block that isn't computed: each zone gets the last of its dated
+    // values, the others are dropped
+    void skip()
+    {
+        for (auto &timed_zone : fTimedZones)
+        {
+            DatedControl control;
+            while (ringbuffer_read(timed_zone.second, (char *)&control, sizeof(DatedControl)) == sizeof(DatedControl))
+                *timed_zone.first = control.fValue;
+        }
+    }
+};
+
+// By default, libfaust may not be used by several threads at once. In
+// multi-thread mode, it serializes the calls that compile, load or delete
+// factories (e.g. from the background threads of several plugin instances)
+static void startMultiThreadedMode()
+{
+    static std::once_flag once;
+    std::call_once(once, [] { startMTDSPFactories(); });
+}
+
+WFactory *w_createDSPFactoryFromFile(const char *filepath, const int argc, const char *argv[], const char *target, int opt_level, char *err_msg_c)
+{
+    startMultiThreadedMode();
     std::string err_msg;
-    WFactory *fac = createPolyDSPFactoryFromFile(filepath, argc, argv, "", err_msg, -1);
+    WFactory *fac = nullptr;
+    std::ifstream file(filepath, std::ios::binary);
+    if (file)
+    {
+        // libfaust gives back the live factory whose key matches, and that
+        // key only depends on the expanded script and the Faust arguments. The
+        // target and optimization level are thus declared in the script, so
+        // that other builds of it get a factory of their own
+        std::stringstream content;
+        content << file.rdbuf() << "\ndeclare faust_jit_build \"" << target << " O" << opt_level << "\";\n";
+        // Named as libfaust names the factories of files
+        std::string name(filepath);
+        name = name.substr(name.find_last_of("/\\") + 1);
+        name = name.substr(0, name.find(".dsp"));
+        fac = createPolyDSPFactoryFromString(name, content.str(), argc, argv, target, err_msg, opt_level);
+    }
+    else
+        err_msg = std::string("Could not open ") + filepath;
     strncpy(err_msg_c, err_msg.c_str(), 4096);
+    if (fac)
+        retainClassInit(fac);
     return fac;
 }
 
-void w_writeFactoryToFolder(WFactory *factory, const char *folder)
+void w_writeFactoryToFolder(WFactory *factory, const char *folder, const char *target)
 {
+    if (!factory)
+        return;
+    startMultiThreadedMode();
     auto prefix = std::string(folder) + "/code";
-    writePolyDSPFactoryToMachineFile(factory, prefix, "");
+    writePolyDSPFactoryToMachineFile(factory, prefix, target);
 }
 
-WFactory *w_readFactoryFromFolder(const char *folder, char *err_msg_c)
+WFactory *w_readFactoryFromFolder(const char *folder, const char *target, char *err_msg_c)
 {
+    startMultiThreadedMode();
     auto prefix = std::string(folder) + "/code";
     std::string err_msg;
-    WFactory *fac = readPolyDSPFactoryFromMachineFile(prefix, "", err_msg);
+    WFactory *fac = readPolyDSPFactoryFromMachineFile(prefix, target, err_msg);
     strncpy(err_msg_c, err_msg.c_str(), 4096);
+    if (fac)
+        retainClassInit(fac);
     return fac;
 }
 
+void w_getDSPMachineTarget(char *target_c, int size)
+{
+    strncpy(target_c, getDSPMachineTarget().c_str(), size - 1);
+    target_c[size - 1] = '\0';
+}
+
 void w_deleteDSPFactory(WFactory *factory)
 {
+    startMultiThreadedMode();
+    releaseClassInit(factory);
     delete factory;
 }
 
-WDsp *w_createDSPInstance(WFactory *factory, int sample_rate, int nvoices, bool group_voices)
+bool w_shareDSPCode(WFactory *a, WFactory *b)
 {
+    return a && b && a->fProcessFactory == b->fProcessFactory;
+}
+
+void w_setDSPMemory(WFactory *factory)
+{
+    factory->setMemoryManager(&gLazyMemory);
+}
+
+bool w_checkDSPFile(const char *filepath, const int argc, const char *argv[], char *err_msg_c)
+{
+    startMultiThreadedMode();
+    std::string sha_key, err_msg;
+    expandDSPFromFile(filepath, argc, argv, sha_key, err_msg);
+    strncpy(err_msg_c, err_msg.c_str(), 4096);
+    return err_msg.empty();
+}
+
+// Creates and initializes a poly instance. `nvoices` is resolved in place (see
+// w_createDSPInstance)
+static dsp_poly *createPolyInstance(WFactory *factory, int sample_rate, int &nvoices, bool group_voices, WDspMemory memory, bool &midiControlledVoices, bool &mappedMemory)
+{
+    std::lock_guard<std::mutex> lock(gMemoryMutex);
+    // Factories given by someone else keep their own memory manager
+    if (dynamic_cast<w_memory_manager *>(factory->getMemoryManager()))
+        factory->setMemoryManager(memoryManager(memory));
+
     // Whether the DSP voices should be controlled by faust from incoming MIDI
     // notes. If not, they will be all alive (and computed) all the time:
-    bool midiControlledVoices = true;
+    midiControlledVoices = true;
 
     if (nvoices == -1)
     {
@@ -73,13 +417,86 @@ WDsp *w_createDSPInstance(WFactory *factory, int sample_rate, int nvoices, bool
         midiControlledVoices = false;
     }
 
-    // timed_dsp is needed for sample-accurate control (such as for MIDI clock).
-    // See https://faustdoc.grame.fr/manual/architectures/#sample-accurate-control
-    WDsp *dsp = new timed_dsp(factory->createPolyDSPInstance(nvoices, midiControlledVoices, group_voices));
-    dsp->init(sample_rate);
+    dsp_poly *dsp = factory->createPolyDSPInstance(nvoices, midiControlledVoices, group_voices);
+    // init() is classInit() followed by instanceInit():
+    classInit(factory->fProcessFactory, sample_rate);
+    if (factory->fEffectFactory)
+        classInit(factory->fEffectFactory, sample_rate);
+    mappedMemory = dynamic_cast<w_memory_manager *>(factory->getMemoryManager()) != nullptr;
+    if (mappedMemory)
+    {
+        // The last step of instanceInit() (instanceClear) only writes zeros to
+        // the delay lines and state of each voice. Fresh pages are already
+        // zeroed, and lazy ones must be left untouched
+        dsp->instanceConstants(sample_rate);
+        dsp->instanceResetUserInterface();
+    }
+    else
+        dsp->instanceInit(sample_rate);
     return dsp;
 }
 
+WDsp *w_createDSPInstance(WFactory *factory, int sample_rate, int nvoices, bool group_voices, WDspMemory memory)
+{
+    bool midiControlledVoices, mappedMemory;
+    dsp_poly *poly = createPolyInstance(factory, sample_rate, nvoices, group_voices, memory, midiControlledVoices, mappedMemory);
+    // Timed zones are needed for sample-accurate control (such as for MIDI
+    // clock)
+    return new w_timed_dsp(poly, mappedMemory);
+}
+
+// The median of the durations, in nanoseconds per sample
+static double medianNsPerSample(std::vector<std::chrono::nanoseconds> &times, int block_size)
+{
+    if (times.empty())
+        return 0.0;
+    std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+    return (double)times[times.size() / 2].count() / block_size;
+}
+
+WCostEstimate w_warmUpFactory(WFactory *factory, int sample_rate, int nvoices, int block_size, int blocks)
+{
+    bool midiControlledVoices, mappedMemory;
+    // Only what the scratch instance touches needs to be resident
+    dsp_poly *dsp = createPolyInstance(factory, sample_rate, nvoices, false, MEMORY_LAZY, midiControlledVoices, mappedMemory);
+    int num_chans = std::max(dsp->getNumInputs(), dsp->getNumOutputs());
+    std::vector<std::vector<float>> bufs(num_chans, std::vector<float>(block_size));
+    std::vector<float *> ptrs(num_chans);
+    // Idle blocks come first, so that no voice is still releasing while they
+    // are timed. The first and third quarters are not timed, as code and data
+    // are still getting into the caches (and the note is starting)
+    std::vector<std::chrono::nanoseconds> held_times, idle_times;
+    for (int i = 0; i < blocks; i++)
+    {
+        if (midiControlledVoices && i == blocks / 2)
+            dsp->keyOn(0, 60, 100);
+        for (int c = 0; c < num_chans; c++)
+        {
+            std::fill(bufs[c].begin(), bufs[c].end(), 0.0f);
+            ptrs[c] = bufs[c].data();
+        }
+        auto start = std::chrono::steady_clock::now();
+        dsp->compute(block_size, ptrs.data(), ptrs.data());
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        if (!midiControlledVoices)
+        {
+            if (i >= blocks / 4)
+                idle_times.push_back(elapsed);
+        }
+        else if (i >= blocks / 4 && i < blocks / 2)
+            idle_times.push_back(elapsed);
+        else if (i >= blocks * 3 / 4)
+            held_times.push_back(elapsed);
+    }
+    delete dsp;
+
+    WCostEstimate estimate;
+    estimate.idle_ns = medianNsPerSample(idle_times, block_size);
+    estimate.voice_ns = midiControlledVoices ? std::max(0.0, medianNsPerSample(held_times, block_size) - estimate.idle_ns) : 0.0;
+    estimate.nvoices = midiControlledVoices ? nvoices : 0;
+    return estimate;
+}
+
 DspInfo w_getDSPInfo(WDsp *dsp)
 {
     return {dsp->getSampleRate(), dsp->getNumInputs(), dsp->getNumOutputs()};
@@ -95,26 +512,45 @@ void w_computeDSP(WDsp *dsp, int count, float **buf)
     dsp->compute(-1, count, buf, buf);
 }
 
-void w_deleteDSPInstance(WDsp *dsp)
+void w_computeDSPDirect(WDsp *dsp, int count, float **buf)
+{
+    // DSPs created by someone else may not be wrapped by us
+    if (w_timed_dsp *timed = dynamic_cast<w_timed_dsp *>(dsp))
+        timed->computeDirect(count, buf, buf);
+    else
+        dsp->compute(-1, count, buf, buf);
+}
+
+void w_skipDSPBlock(WDsp *dsp)
+{
+    if (w_timed_dsp *timed = dynamic_cast<w_timed_dsp *>(dsp))
+        timed->skip();
+}
+
+void w_clearDSP(WDsp *dsp)
 {
     dsp->instanceClear();
-    delete dsp;
 }
 
-extern "C"
+void w_deleteDSPInstance(WDsp *dsp)
 {
-    // These will be defined in Rust
-    void rs_declare_widget(void *builder, const char *label, WWidgetDecl decl);
-    void rs_declare_metadata(void *builder, FAUSTFLOAT *zone, const char *key, const char *value);
+    // Clearing memory that is about to be unmapped would only make it resident
+    w_timed_dsp *timed = dynamic_cast<w_timed_dsp *>(dsp);
+    if (!timed || !timed->fMappedMemory)
+        dsp->instanceClear();
+    delete dsp;
 }
 
 class WidgetDeclGUI : public GUI
 {
 private:
     void *fBuilder;
+    WDeclareWidgetFn fDeclareWidget;
+    WDeclareMetadataFn fDeclareMetadata;
 
 public:
-    WidgetDeclGUI(void *builder) : GUI(), fBuilder(builder)
+    WidgetDeclGUI(void *builder, WDeclareWidgetFn declare_widget, WDeclareMetadataFn declare_metadata)
+        : GUI(), fBuilder(builder), fDeclareWidget(declare_widget), fDeclareMetadata(declare_metadata)
     {
     }
 
@@ -124,56 +560,56 @@ public:
 
     void openTabBox(const char *label)
     {
-        rs_declare_widget(fBuilder, label, {TAB_BOX, nullptr, 0, 0, 0, 0});
+        fDeclareWidget(fBuilder, label, {TAB_BOX, nullptr, 0, 0, 0, 0});
     }
 
     void openHorizontalBox(const char *label)
     {
-        rs_declare_widget(fBuilder, label, {HORIZONTAL_BOX, nullptr, 0, 0, 0, 0});
+        fDeclareWidget(fBuilder, label, {HORIZONTAL_BOX, nullptr, 0, 0, 0, 0});
     }
 
     void openVerticalBox(const char *label)
     {
-        rs_declare_widget(fBuilder, label, {VERTICAL_BOX, nullptr, 0, 0, 0, 0});
+        fDeclareWidget(fBuilder, label, {VERTICAL_BOX, nullptr, 0, 0, 0, 0});
     }
 
     void closeBox()
     {
-        rs_declare_widget(fBuilder, "", {CLOSE_BOX, nullptr, 0, 0, 0, 0});
+        fDeclareWidget(fBuilder, "", {CLOSE_BOX, nullptr, 0, 0, 0, 0});
     }
 
     void addButton(const char *label, FAUSTFLOAT *zone)
     {
-        rs_declare_widget(fBuilder, label, {BUTTON, zone, 0, 0, 0, 0});
+        fDeclareWidget(fBuilder, label, {BUTTON, zone, 0, 0, 0, 0});
     }
 
     void addCheckButton(const char *label, FAUSTFLOAT *zone)
     {
-        rs_declare_widget(fBuilder, label, {CHECK_BUTTON, zone, 0, 0, 0, 0});
+        fDeclareWidget(fBuilder, label, {CHECK_BUTTON, zone, 0, 0, 0, 0});
     }
 
     void addVerticalSlider(const char *label, FAUSTFLOAT *zone, FAUSTFLOAT init, FAUSTFLOAT min, FAUSTFLOAT max, FAUSTFLOAT step)
     {
-        rs_declare_widget(fBuilder, label, {VERTICAL_SLIDER, zone, init, min, max, step});
+        fDeclareWidget(fBuilder, label, {VERTICAL_SLIDER, zone, init, min, max, step});
     }
 
     void addHorizontalSlider(const char *label, FAUSTFLOAT *zone, FAUSTFLOAT init, FAUSTFLOAT min, FAUSTFLOAT max, FAUSTFLOAT step)
     {
-        rs_declare_widget(fBuilder, label, {HORIZONTAL_SLIDER, zone, init, min, max, step});
+        fDeclareWidget(fBuilder, label, {HORIZONTAL_SLIDER, zone, init, min, max, step});
     }
     void addNumEntry(const char *label, FAUSTFLOAT *zone, FAUSTFLOAT init, FAUSTFLOAT min, FAUSTFLOAT max, FAUSTFLOAT step)
     {
-        rs_declare_widget(fBuilder, label, {NUM_ENTRY, zone, init, min, max, step});
+        fDeclareWidget(fBuilder, label, {NUM_ENTRY, zone, init, min, max, step});
     }
 
     void addHorizontalBargraph(const char *label, FAUSTFLOAT *zone, FAUSTFLOAT min, FAUSTFLOAT max)
     {
-        rs_declare_widget(fBuilder, label, {HORIZONTAL_BARGRAPH, zone, 0, min, max, 0});
+        fDeclareWidget(fBuilder, label, {HORIZONTAL_BARGRAPH, zone, 0, min, max, 0});
     }
 
     void addVerticalBargraph(const char *label, FAUSTFLOAT *zone, FAUSTFLOAT min, FAUSTFLOAT max)
     {
-        rs_declare_widget(fBuilder, label, {VERTICAL_BARGRAPH, zone, 0, min, max, 0});
+        fDeclareWidget(fBuilder, label, {VERTICAL_BARGRAPH, zone, 0, min, max, 0});
     }
 
     // -- soundfiles. TODO
@@ -181,47 +617,108 @@ public:
 
     void declare(FAUSTFLOAT *zone, const char *key, const char *value)
     {
-        rs_declare_metadata(fBuilder, zone, key, value);
+        fDeclareMetadata(fBuilder, zone, key, value);
     }
 };
 
+// Collects the zones of a DSP
+class ZonesUI : public UI
+{
+public:
+    std::vector<FAUSTFLOAT *> fZones;
+
+    void openTabBox(const char *label) {}
+    void openHorizontalBox(const char *label) {}
+    void openVerticalBox(const char *label) {}
+    void closeBox() {}
+
+    void addButton(const char *label, FAUSTFLOAT *zone) { fZones.push_back(zone); }
+    void addCheckButton(const char *label, FAUSTFLOAT *zone) { fZones.push_back(zone); }
+    void addVerticalSlider(const char *label, FAUSTFLOAT *zone, FAUSTFLOAT init, FAUSTFLOAT min, FAUSTFLOAT max, FAUSTFLOAT step) { fZones.push_back(zone); }
+    void addHorizontalSlider(const char *label, FAUSTFLOAT *zone, FAUSTFLOAT init, FAUSTFLOAT min, FAUSTFLOAT max, FAUSTFLOAT step) { fZones.push_back(zone); }
+    void addNumEntry(const char *label, FAUSTFLOAT *zone, FAUSTFLOAT init, FAUSTFLOAT min, FAUSTFLOAT max, FAUSTFLOAT step) { fZones.push_back(zone); }
+    void addHorizontalBargraph(const char *label, FAUSTFLOAT *zone, FAUSTFLOAT min, FAUSTFLOAT max) { fZones.push_back(zone); }
+    void addVerticalBargraph(const char *label, FAUSTFLOAT *zone, FAUSTFLOAT min, FAUSTFLOAT max) { fZones.push_back(zone); }
+
+    void addSoundfile(const char *label, const char *filename, Soundfile **sf_zone) {}
+
+    void declare(FAUSTFLOAT *zone, const char *key, const char *value) {}
+};
+
+static void freeTimedZone(FAUSTFLOAT *zone)
+{
+    auto it = GUI::gTimedZoneMap.find(zone);
+    if (it != GUI::gTimedZoneMap.end())
+    {
+        ringbuffer_free(it->second);
+        GUI::gTimedZoneMap.erase(it);
+    }
+}
+
 struct WUIs
 {
     midi_handler *fMidiHandler;
     MidiUI *fMidiUi;
     WidgetDeclGUI *fWidgetGui;
+    // The zones the MidiUI made timed, to be unregistered with it
+    std::vector<FAUSTFLOAT *> fTimedZones;
 };
 
-WUIs *w_createUIs(WDsp *dsp, void *gui_builder)
+WUIs *w_createUIs(WDsp *dsp, void *gui_builder, WDeclareWidgetFn declare_widget, WDeclareMetadataFn declare_metadata)
 {
+    std::lock_guard<std::shared_timed_mutex> lock(gGuiGlobalsMutex);
+    ZonesUI zones;
+    dsp->buildUserInterface(&zones);
+    // Leftovers of a deleted DSP whose memory had the same address
+    for (FAUSTFLOAT *zone : zones.fZones)
+        freeTimedZone(zone);
+
     WUIs *uis = new WUIs();
     uis->fMidiHandler = new midi_handler();
     uis->fMidiUi = new MidiUI(uis->fMidiHandler);
-    uis->fWidgetGui = new WidgetDeclGUI(gui_builder);
+    uis->fWidgetGui = new WidgetDeclGUI(gui_builder, declare_widget, declare_metadata);
     dsp->buildUserInterface(uis->fMidiUi);
     dsp->buildUserInterface(uis->fWidgetGui);
     uis->fMidiUi->run();
     uis->fWidgetGui->run();
+
+    w_timed_dsp *timed = dynamic_cast<w_timed_dsp *>(dsp);
+    for (FAUSTFLOAT *zone : zones.fZones)
+    {
+        auto it = GUI::gTimedZoneMap.find(zone);
+        if (it == GUI::gTimedZoneMap.end())
+            continue;
+        uis->fTimedZones.push_back(zone);
+        if (timed)
+            timed->addTimedZone(zone, it->second);
+    }
     return uis;
 }
 
 void w_deleteUIs(WUIs *uis)
 {
+    std::lock_guard<std::shared_timed_mutex> lock(gGuiGlobalsMutex);
     uis->fMidiUi->stop();
     uis->fWidgetGui->stop();
     delete uis->fMidiUi;
     delete uis->fMidiHandler;
     delete uis->fWidgetGui;
+    for (FAUSTFLOAT *zone : uis->fTimedZones)
+        freeTimedZone(zone);
     delete uis;
 }
 
-void w_updateAllGuis()
+void w_updateGuis(WUIs *uis)
 {
-    GUI::updateAllGuis();
+    uis->fMidiUi->updateAllZones();
+    uis->fWidgetGui->updateAllZones();
 }
 
 void w_handleRawMidi(WUIs *uis, double time, const unsigned char bytes[3])
 {
+    // Timed MIDI items look their ringbuffer up in GUI::gTimedZoneMap
+    std::shared_lock<std::shared_timed_mutex> lock(gGuiGlobalsMutex);
+
     // Faust expects status (type) bits _not_ to be shifted, so
     // we leave status bits in place and just set the other ones
     // to zero:
@@ -239,5 +736,38 @@ void w_handleRawMidi(WUIs *uis, double time, const unsigned char bytes[3])
 
 void w_handleMidiSync(WUIs *uis, double time, WMidiSyncMsg status)
 {
+    std::shared_lock<std::shared_timed_mutex> lock(gGuiGlobalsMutex);
     uis->fMidiHandler->handleSync(time, status);
 }
+
+bool w_addTimedZone(WDsp *dsp, float *zone)
+{
+    std::lock_guard<std::shared_timed_mutex> lock(gGuiGlobalsMutex);
+    auto it = GUI::gTimedZoneMap.find(zone);
+    bool added = it == GUI::gTimedZoneMap.end();
+    if (added)
+        it = GUI::gTimedZoneMap.insert({zone, ringbuffer_create(8192)}).first;
+    if (w_timed_dsp *timed = dynamic_cast<w_timed_dsp *>(dsp))
+        timed->addTimedZone(zone, it->second);
+    return added;
+}
+
+void w_removeTimedZone(WDsp *dsp, float *zone)
+{
+    std::lock_guard<std::shared_timed_mutex> lock(gGuiGlobalsMutex);
+    if (w_timed_dsp *timed = dynamic_cast<w_timed_dsp *>(dsp))
+        timed->removeTimedZone(zone);
+    freeTimedZone(zone);
+}
+
+void w_setTimedZoneValue(WDsp *dsp, float *zone, double time, float value)
+{
+    DatedControl dated_val(time, value);
+    if (w_timed_dsp *timed = dynamic_cast<w_timed_dsp *>(dsp))
+    {
+        ringbuffer_write(timed->timedZone(zone), (const char *)&dated_val, sizeof(DatedControl));
+        return;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(gGuiGlobalsMutex);
+    ringbuffer_write(GUI::gTimedZoneMap[zone], (const char *)&dated_val, sizeof(DatedControl));
+}
@@ -12,14 +12,54 @@ struct dsp;
 typedef dsp_poly_factory WFactory;
 typedef dsp WDsp;
 
-WFactory *w_createDSPFactoryFromFile(const char *filepath, const int argc, const char *argv[], char *err_msg_c);
+// Everything is declared with C linkage, so that symbol names are the same
+// whether the wrapper is statically linked in or loaded at runtime as a shared
+// object (see the `lazy_engine` feature)
+extern "C"
+{
+
+// `target` is an LLVM machine target ("triple:cpu"). An empty string means the
+// current machine, with all the features of its CPU. `opt_level` is the LLVM
+// optimization level, -1 meaning the highest one
+WFactory *w_createDSPFactoryFromFile(const char *filepath, const int argc, const char *argv[], const char *target, int opt_level, char *err_msg_c);
+
+void w_writeFactoryToFolder(WFactory *factory, const char *folder, const char *target);
 
-void w_writeFactoryToFolder(WFactory *factory, const char *folder);
+WFactory *w_readFactoryFromFolder(const char *folder, const char *target, char *err_msg_c);
 
-WFactory *w_readFactoryFromFolder(const char *folder, char *err_msg_c);
+// Writes in target_c (of size `size`) the LLVM machine target of the current
+// machine
+void w_getDSPMachineTarget(char *target_c, int size);
 
 void w_deleteDSPFactory(WFactory *factory);
 
+// Whether both factories run the same code, libfaust giving back a live
+// factory when asked for one with the same key
+bool w_shareDSPCode(WFactory *a, WFactory *b);
+
+// How the memory of an instance is allocated. It always comes directly from
+// the OS, as pages that are zeroed, so the initialization of the instance
+// skips clearing it
+enum WDspMemory
+{
+    // Pages become resident on first access, so only the parts a DSP actually
+    // writes do. The first blocks computed may page fault
+    MEMORY_LAZY,
+    // All pages are made resident when the instance is created
+    MEMORY_PREFAULTED,
+    // Same, and the pages are also locked in RAM (if the OS allows it)
+    MEMORY_LOCKED,
+};
+
+// Makes the instances of the factory allocate their memory as
+// w_createDSPInstance is told to. Instances of factories that aren't set up
+// this way use the memory manager of the factory (or the heap)
+void w_setDSPMemory(WFactory *factory);
+
+// Runs only the Faust front-end (parsing and evaluation of the script, no
+// code generation). Returns false and fills err_msg_c if the script has errors
+bool w_checkDSPFile(const char *filepath, const int argc, const char *argv[], char *err_msg_c);
+
 // The `nvoices` parameter can be set to:
 //
 //   -1 => use the `declare options "[nvoices:xxx]"` metadata in the DSP script.
@@ -37,7 +77,8 @@ void w_deleteDSPFactory(WFactory *factory);
 //   sent. This is _not_ an intended feature of the plugin, just a consequence
 //   of how Faust handles polyphony.
 //
-WDsp *w_createDSPInstance(WFactory *factory, int sample_rate, int nvoices, bool group_voices);
+// `memory` is only used for factories set up with w_setDSPMemory
+WDsp *w_createDSPInstance(WFactory *factory, int sample_rate, int nvoices, bool group_voices, WDspMemory memory);
 
 /* Information about the currently loaded DSP
  */
@@ -52,6 +93,40 @@ DspInfo w_getDSPInfo(WDsp *dsp);
 
 void w_computeDSP(WDsp *dsp, int count, float **buf);
 
+// Computes the wrapped DSP directly, skipping the timed_dsp layer. Only valid
+// when no dated zone update (MIDI, smoothing...) is pending, as these would
+// otherwise be applied late
+void w_computeDSPDirect(WDsp *dsp, int count, float **buf);
+
+// Applies the dated zone updates (MIDI...) of a block that isn't computed,
+// so they don't pile up for the next computed one. Each zone only gets its
+// last value
+void w_skipDSPBlock(WDsp *dsp);
+
+// What w_warmUpFactory measured, in nanoseconds per sample on the calling
+// thread
+struct WCostEstimate
+{
+    // The cost with no note held, or the cost of an effect
+    double idle_ns;
+    // What each held note adds to it (0 for effects)
+    double voice_ns;
+    // How many notes can be held at once (0 for effects)
+    int nvoices;
+};
+
+// Computes `blocks` blocks of silence with a scratch instance of the factory
+// (holding a note during the second half, for instruments), so the code of the
+// factory is hot and fully resolved before its real instances go live. The
+// second and fourth quarters are timed (all but the first one for effects), to
+// estimate what its instances cost.
+// `nvoices` is the same as for w_createDSPInstance
+WCostEstimate w_warmUpFactory(WFactory *factory, int sample_rate, int nvoices, int block_size, int blocks);
+
+// Resets the internal state of the DSP (delay lines, filters...) without
+// touching its parameters
+void w_clearDSP(WDsp *dsp);
+
 void w_deleteDSPInstance(WDsp *dsp);
 
 enum WWidgetDeclType
@@ -83,11 +158,20 @@ struct WWidgetDecl
 
 struct WUIs;
 
-WUIs *w_createUIs(WDsp *dsp, void *gui_builder);
+// Callbacks through which the widgets and their metadata are declared to the
+// gui_builder. They are passed explicitly (instead of being linked against) so
+// that the wrapper does not depend on any symbol from the Rust side
+typedef void (*WDeclareWidgetFn)(void *gui_builder, const char *label, WWidgetDecl decl);
+typedef void (*WDeclareMetadataFn)(void *gui_builder, float *zone, const char *key, const char *value);
+
+WUIs *w_createUIs(WDsp *dsp, void *gui_builder, WDeclareWidgetFn declare_widget, WDeclareMetadataFn declare_metadata);
 
 void w_deleteUIs(WUIs *h);
 
-void w_updateAllGuis();
+// Updates what the UIs of this DSP reflect from its zones (e.g. sends the MIDI
+// of its output widgets). Only touches this instance, unlike
+// GUI::updateAllGuis which updates the UIs of every instance of the process
+void w_updateGuis(WUIs *h);
 
 void w_handleRawMidi(WUIs *h, double time, const unsigned char bytes[3]);
 
@@ -102,4 +186,17 @@ enum WMidiSyncMsg
 
 void w_handleMidiSync(WUIs *h, double time, WMidiSyncMsg status);
 
+// Registers a zone of the DSP in its timed zones, which are used for
+// sample-accurate control, so dated values can then be scheduled for it.
+// Returns false if the zone was already registered (e.g. by the MidiUI)
+bool w_addTimedZone(WDsp *dsp, float *zone);
+
+void w_removeTimedZone(WDsp *dsp, float *zone);
+
+// Schedules a new value for a timed zone of the DSP, at some sample offset of
+// the next computed buffer
+void w_setTimedZoneValue(WDsp *dsp, float *zone, double time, float value);
+
+}
+
 #endif
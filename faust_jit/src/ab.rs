@@ -0,0 +1,256 @@
+//! Side-by-side comparison of two builds of a DSP (e.g. with other compile
+//! options, or a rewritten version of the script)
+//!
+//! The reference DSP (A) is used as usual, and an [`AbComparison`] holds the
+//! other variant (B). Parameters are matched by path and copied from A to B at
+//! each block, so B follows the GUI, OSC... of A. Either variant can be the
+//! audible one, switching being instant. By default only the audible one is
+//! computed: the other one still takes in its MIDI at each block (so its notes
+//! and controllers are up to date when switching to it), but its audio state
+//! stays as it was when it was last computed. When computing both, the silent
+//! one works on a copy of the input, and the difference between their outputs
+//! is measured.
+
+use super::SingletonDsp;
+use std::{
+    sync::{
+        atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering},
+        Mutex,
+    },
+    time::{Duration, Instant},
+};
+
+/// Weight of the last block in the moving averages
+const STATS_SMOOTHING: f32 = 0.05;
+
+/// Max number of channels of the variants, so the slices of the silent one
+/// can live in an array on the audio thread's stack
+pub const MAX_CHANNELS: usize = 16;
+
+#[derive(Debug, Clone, Copy)]
+/// What [`AbComparison::stats`] returns
+pub struct AbStats {
+    /// Moving average of the load of each variant (compute time divided by
+    /// the duration of the block). None until the variant has been computed
+    pub load_a: Option<f32>,
+    pub load_b: Option<f32>,
+    /// Moving average of the RMS of the difference between both outputs,
+    /// relative to the RMS of A's output, in dB. None until both have been
+    /// computed on the same block
+    pub difference_db: Option<f32>,
+    /// Whether all the blocks computed by both variants gave the very same
+    /// samples
+    pub bit_identical: bool,
+}
+
+/// An f32 that can be shared between the audio thread and the GUI. NaN means
+/// no value yet
+#[derive(Debug)]
+struct AtomicStat(AtomicU32);
+
+impl AtomicStat {
+    fn new() -> Self {
+        Self(AtomicU32::new(f32::NAN.to_bits()))
+    }
+
+    fn get(&self) -> Option<f32> {
+        let v = f32::from_bits(self.0.load(Ordering::Relaxed));
+        (!v.is_nan()).then_some(v)
+    }
+
+    /// Moves the moving average towards `value`
+    fn update(&self, value: f32) {
+        let new = match self.get() {
+            Some(old) => old + (value - old) * STATS_SMOOTHING,
+            None => value,
+        };
+        self.0.store(new.to_bits(), Ordering::Relaxed);
+    }
+}
+
+#[derive(Debug)]
+pub struct AbComparison {
+    b: SingletonDsp,
+    /// The DSP that was A when this comparison was created
+    a_id: u64,
+    /// Indices in the params of A and B of the parameters they share
+    param_map: Vec<(usize, usize)>,
+    listen_b: AtomicBool,
+    compute_both: AtomicBool,
+    /// Where the silent variant is computed. Only locked by the audio thread
+    scratch: Mutex<Vec<Vec<f32>>>,
+    load_a: AtomicStat,
+    load_b: AtomicStat,
+    sq_difference: AtomicStat,
+    sq_reference: AtomicStat,
+    differing_blocks: AtomicU64,
+}
+
+impl AbComparison {
+    /// `b` should have the same number of channels as `a`, and at most
+    /// [`MAX_CHANNELS`] inputs and outputs. When computing both, blocks longer
+    /// than `max_block_size` only compute the audible variant
+    pub fn new(a: &SingletonDsp, b: SingletonDsp, max_block_size: usize) -> Result<Self, String> {
+        if (a.info.num_inputs, a.info.num_outputs) != (b.info.num_inputs, b.info.num_outputs) {
+            return Err(format!(
+                "Variant B has {} inputs and {} outputs, instead of {} and {}",
+                b.info.num_inputs, b.info.num_outputs, a.info.num_inputs, a.info.num_outputs
+            ));
+        }
+        let num_chans = b.info.num_inputs.max(b.info.num_outputs) as usize;
+        if num_chans > MAX_CHANNELS {
+            return Err(format!(
+                "Cannot compare DSPs with more than {} channels",
+                MAX_CHANNELS
+            ));
+        }
+        let param_map = a
+            .params
+            .iter()
+            .enumerate()
+            .filter_map(|(i, pa)| {
+                b.params
+                    .iter()
+                    .position(|pb| pb.path == pa.path)
+                    .map(|j| (i, j))
+            })
+            .collect();
+        Ok(Self {
+            a_id: a.id,
+            param_map,
+            listen_b: AtomicBool::new(false),
+            compute_both: AtomicBool::new(false),
+            scratch: Mutex::new(vec![vec![0.0; max_block_size]; num_chans]),
+            load_a: AtomicStat::new(),
+            load_b: AtomicStat::new(),
+            sq_difference: AtomicStat::new(),
+            sq_reference: AtomicStat::new(),
+            differing_blocks: AtomicU64::new(0),
+            b,
+        })
+    }
+
+    pub fn variant_b(&self) -> &SingletonDsp {
+        &self.b
+    }
+
+    pub fn set_listen_b(&self, listen_b: bool) {
+        self.listen_b.store(listen_b, Ordering::Relaxed);
+    }
+
+    pub fn listening_b(&self) -> bool {
+        self.listen_b.load(Ordering::Relaxed)
+    }
+
+    /// Whether the silent variant should also be computed, to compare the
+    /// outputs and keep its state in sync
+    pub fn set_compute_both(&self, compute_both: bool) {
+        self.compute_both.store(compute_both, Ordering::Relaxed);
+    }
+
+    pub fn computing_both(&self) -> bool {
+        self.compute_both.load(Ordering::Relaxed)
+    }
+
+    pub fn stats(&self) -> AbStats {
+        AbStats {
+            load_a: self.load_a.get(),
+            load_b: self.load_b.get(),
+            difference_db: self
+                .sq_difference
+                .get()
+                .zip(self.sq_reference.get())
+                .map(|(d, r)| 10.0 * (d / r.max(f32::MIN_POSITIVE)).log10()),
+            bit_identical: self.differing_blocks.load(Ordering::Relaxed) == 0,
+        }
+    }
+
+    /// To be called along with [`SingletonDsp::handle_raw_midi`] on A, so B
+    /// gets the same notes
+    pub fn handle_raw_midi(&self, timestamp: f64, midi_data: [u8; 3]) {
+        self.b.handle_raw_midi(timestamp, midi_data);
+    }
+
+    /// To be called along with [`SingletonDsp::handle_midi_sync`] on A
+    pub fn handle_midi_sync(&self, playing: bool, opt_clock_data: &Option<super::ClockData>) {
+        self.b.handle_midi_sync(playing, opt_clock_data);
+    }
+
+    /// Replaces `a.process_buffers(audio_bufs)`. `a` must be the DSP given to
+    /// [`Self::new`], otherwise only `a` is computed
+    pub fn process_buffers(&self, a: &SingletonDsp, audio_bufs: &mut [&mut [f32]]) {
+        if a.id != self.a_id {
+            a.process_buffers(audio_bufs);
+            self.b.skip_block();
+            return;
+        }
+        for &(i, j) in &self.param_map {
+            let pb = &self.b.params[j];
+            unsafe { *pb.zone = (*a.params[i].zone).clamp(pb.min, pb.max) };
+        }
+        // Read once, as the GUI may switch during the block
+        let listening_b = self.listening_b();
+        let (audible, silent, audible_load, silent_load) = if listening_b {
+            (&self.b, a, &self.load_b, &self.load_a)
+        } else {
+            (a, &self.b, &self.load_a, &self.load_b)
+        };
+        let samples = audio_bufs.first().map_or(0, |b| b.len());
+        let block_duration =
+            Duration::from_secs_f64(samples as f64 / a.info.sample_rate.max(1) as f64);
+        let timed = |dsp: &SingletonDsp, bufs: &mut [&mut [f32]], load: &AtomicStat| {
+            let start = Instant::now();
+            dsp.process_buffers(bufs);
+            load.update(start.elapsed().as_secs_f32() / block_duration.as_secs_f32());
+        };
+
+        let mut scratch = match self.scratch.try_lock() {
+            Ok(scratch) if self.computing_both() && samples > 0 => scratch,
+            _ => {
+                silent.skip_block();
+                timed(audible, audio_bufs, audible_load);
+                return;
+            }
+        };
+        if scratch.first().is_some_and(|s| s.len() < samples) {
+            silent.skip_block();
+            timed(audible, audio_bufs, audible_load);
+            return;
+        }
+        // No allocation, as new() refused more than MAX_CHANNELS channels
+        let mut silent_bufs: [&mut [f32]; MAX_CHANNELS] = Default::default();
+        let num_chans = scratch.len().min(audio_bufs.len());
+        for ((dst, src), slot) in scratch
+            .iter_mut()
+            .zip(audio_bufs.iter())
+            .zip(silent_bufs.iter_mut())
+            .take(num_chans)
+        {
+            dst[..samples].copy_from_slice(src);
+            *slot = &mut dst[..samples];
+        }
+        timed(silent, &mut silent_bufs[..num_chans], silent_load);
+        timed(audible, audio_bufs, audible_load);
+
+        let num_outputs = (a.info.num_outputs as usize).min(num_chans);
+        let mut sq_difference = 0.0f32;
+        let mut sq_reference = 0.0f32;
+        let mut identical = true;
+        for (s, o) in silent_bufs[..num_outputs]
+            .iter()
+            .zip(audio_bufs.iter())
+            .flat_map(|(s, o)| s.iter().zip(o.iter()))
+        {
+            identical &= s.to_bits() == o.to_bits();
+            sq_difference += (s - o) * (s - o);
+            let reference = if listening_b { s } else { o };
+            sq_reference += reference * reference;
+        }
+        let n = (samples * num_outputs).max(1) as f32;
+        self.sq_difference.update(sq_difference / n);
+        self.sq_reference.update(sq_reference / n);
+        if !identical {
+            self.differing_blocks.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+}
@@ -5,8 +5,14 @@ use std::path::{Path, PathBuf};
 
 /// A folder where to store results of _deterministic_ computations. Light to
 /// clone
+///
+/// Read-only layers (e.g. packs of precompiled results installed along with an
+/// application) can be added in front of it. They have the same layout as the
+/// cache folder itself, and are queried in order before it. Results are only
+/// ever written to the cache folder
 #[derive(Clone)]
 pub struct Cache {
+    read_only_layers: Vec<PathBuf>,
     root: PathBuf,
 }
 
@@ -25,30 +31,70 @@ impl Cache {
     /// Open a cache in a folder, ensuring it exists
     pub fn new(cache_folder: PathBuf) -> Self {
         fs::create_dir_all(&cache_folder).expect("Cache root folder couldn't be created");
-        Self { root: cache_folder }
+        Self {
+            read_only_layers: vec![],
+            root: cache_folder,
+        }
+    }
+
+    /// Adds read-only layers, to be queried (in the given order) before the
+    /// cache folder. Layers that don't exist are just ignored, so that an
+    /// application can always look for optional packs
+    pub fn with_read_only_layers(mut self, layers: impl IntoIterator<Item = PathBuf>) -> Self {
+        self.read_only_layers.extend(layers);
+        self
+    }
+
+    /// Where the result of some computation is, if any layer or the cache
+    /// folder has it
+    fn find(&self, digest: &sha1::Digest) -> Option<PathBuf> {
+        let entry = digest.to_hex_lowercase();
+        self.read_only_layers
+            .iter()
+            .chain(std::iter::once(&self.root))
+            .map(|folder| folder.join(&entry))
+            .find(|dir| dir.exists())
     }
 
     /// Hash the inputs of some computation. T can just be &Path
     pub fn hash_input<T: Chksumable + Clone>(
+        input: T,
+        other_inputs: &[T],
+    ) -> Result<CacheId, sha1::Error> {
+        Self::hash_input_with_salt(input, other_inputs, "")
+    }
+
+    /// Like [`Self::hash_input`], but the salt (which describes _how_ the
+    /// computation is done, e.g. with which compilation options) is also
+    /// hashed. An empty salt gives the same result as [`Self::hash_input`]
+    pub fn hash_input_with_salt<T: Chksumable + Clone>(
         mut input: T,
         other_inputs: &[T],
+        salt: &str,
     ) -> Result<CacheId, sha1::Error> {
         let mut sha1 = SHA1::new();
         input.chksum_with(&mut sha1)?;
         for p in other_inputs {
             p.clone().chksum_with(&mut sha1)?;
         }
+        sha1.update(salt);
         Ok(CacheId(sha1.digest()))
     }
 
+    /// Whether a computation's result is already in cache, without preparing
+    /// anything to write it
+    pub fn contains(&self, CacheId(digest): &CacheId) -> bool {
+        self.find(digest).is_some()
+    }
+
     /// Query if a computation's result is already in cache. If not, returns a
     /// way to write the result
     pub fn query(&self, CacheId(digest): CacheId) -> CacheQueryResult {
-        let mut final_dir = self.root.clone();
-        final_dir.push(digest.to_hex_lowercase());
-        if final_dir.exists() {
-            CacheQueryResult::Hit(final_dir)
+        if let Some(dir) = self.find(&digest) {
+            CacheQueryResult::Hit(dir)
         } else {
+            let mut final_dir = self.root.clone();
+            final_dir.push(digest.to_hex_lowercase());
             let mut temp_dir = self.root.clone();
             temp_dir.push(format!(
                 "tmp-{}-{}",
@@ -0,0 +1,163 @@
+//! Fast validation of scripts, for quick error feedback while editing them
+//!
+//! Only the Faust front-end runs (parsing, evaluation and type checking of the
+//! block diagram), so nothing is generated or compiled by LLVM. A broken
+//! script is reported in milliseconds, without touching the DSP currently
+//! loaded.
+
+use super::wrapper::*;
+use std::{
+    ffi::CStr,
+    fmt,
+    path::{Path, PathBuf},
+};
+
+#[derive(Debug, Clone, PartialEq)]
+/// An error reported by the Faust compiler
+pub struct ScriptError {
+    /// The file (the script, or a file it imports) and the line of the error,
+    /// when Faust tells them
+    pub location: Option<(PathBuf, u32)>,
+    pub message: String,
+}
+
+impl fmt::Display for ScriptError {
+    /// Formatted like other compilers' errors (`file:line: message`) so that
+    /// editors can jump to them
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match &self.location {
+            Some((file, line)) => write!(f, "{}:{}: {}", file.display(), line, self.message),
+            None => f.write_str(&self.message),
+        }
+    }
+}
+
+impl ScriptError {
+    fn without_location(message: impl Into<String>) -> Self {
+        Self {
+            location: None,
+            message: message.into(),
+        }
+    }
+
+    /// Faust reports errors as `file : line : ERROR : message`, or just
+    /// `ERROR : message` when it has no location, one per line
+    fn parse_all(faust_msg: &str) -> Vec<Self> {
+        let strip = |m: &str| m.trim().trim_start_matches("ERROR : ").to_string();
+        faust_msg
+            .lines()
+            .filter(|l| !l.trim().is_empty())
+            .map(|l| {
+                let parts: Vec<&str> = l.splitn(3, " : ").collect();
+                match parts.as_slice() {
+                    // An unlocated message may itself contain ` : `
+                    [file, line, message] if file.trim() != "ERROR" => match line.trim().parse() {
+                        Ok(line) => Self {
+                            location: Some((PathBuf::from(file.trim()), line)),
+                            message: strip(message),
+                        },
+                        Err(_) => Self::without_location(strip(l)),
+                    },
+                    _ => Self::without_location(strip(l)),
+                }
+            })
+            .collect()
+    }
+}
+
+/// Checks that a script is valid, without compiling it. `import_paths` are
+/// used as in [`crate::SingletonDsp::from_file`]
+pub fn check_script(script_path: &Path, import_paths: &[&Path]) -> Result<(), Vec<ScriptError>> {
+    load_engine().map_err(|e| vec![ScriptError::without_location(e)])?;
+    let (script_path, args) = crate::script_args(script_path, import_paths)
+        .map_err(|e| vec![ScriptError::without_location(e)])?;
+    let mut args_ptrs: Vec<_> = args.iter().map(|cstring| cstring.as_ptr()).collect();
+    let mut error_msg_buf = [0; 4096];
+    let ok = unsafe {
+        w_checkDSPFile(
+            script_path.as_ptr(),
+            args_ptrs.len() as i32,
+            args_ptrs.as_mut_ptr(),
+            error_msg_buf.as_mut_ptr(),
+        )
+    };
+    if ok {
+        Ok(())
+    } else {
+        let error_msg = unsafe { CStr::from_ptr(error_msg_buf.as_ptr()) }.to_string_lossy();
+        let errors = ScriptError::parse_all(&error_msg);
+        if errors.is_empty() {
+            Err(vec![ScriptError::without_location("Unknown Faust error")])
+        } else {
+            Err(errors)
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn located(file: &str, line: u32, message: &str) -> ScriptError {
+        ScriptError {
+            location: Some((PathBuf::from(file), line)),
+            message: message.into(),
+        }
+    }
+
+    #[test]
+    fn parses_located_errors() {
+        assert_eq!(
+            ScriptError::parse_all("/tmp/synth.dsp : 12 : ERROR : undefined symbol : foo\n"),
+            vec![located("/tmp/synth.dsp", 12, "undefined symbol : foo")]
+        );
+        // One per line, blank lines being skipped:
+        assert_eq!(
+            ScriptError::parse_all(
+                "a.dsp : 1 : ERROR : first\n\n  \nC:\\lib\\b.lib : 20 : ERROR : second\n"
+            ),
+            vec![
+                located("a.dsp", 1, "first"),
+                located("C:\\lib\\b.lib", 20, "second")
+            ]
+        );
+    }
+
+    #[test]
+    fn parses_unlocated_errors() {
+        assert_eq!(
+            ScriptError::parse_all("ERROR : the script has no process\n"),
+            vec![ScriptError::without_location("the script has no process")]
+        );
+        assert_eq!(
+            ScriptError::parse_all("ERROR : inputs : 2, outputs : 1"),
+            vec![ScriptError::without_location("inputs : 2, outputs : 1")]
+        );
+        // Not to be mistaken for a file and a line:
+        assert_eq!(
+            ScriptError::parse_all("ERROR : 3 : not a location"),
+            vec![ScriptError::without_location("3 : not a location")]
+        );
+        // Anything else is kept as is:
+        assert_eq!(
+            ScriptError::parse_all("Segmentation fault"),
+            vec![ScriptError::without_location("Segmentation fault")]
+        );
+    }
+
+    #[test]
+    fn keeps_lines_with_a_non_numeric_line_field_whole() {
+        assert_eq!(
+            ScriptError::parse_all("a.dsp : twelve : ERROR : oops"),
+            vec![ScriptError::without_location(
+                "a.dsp : twelve : ERROR : oops"
+            )]
+        );
+    }
+
+    #[test]
+    fn formats_like_other_compilers() {
+        assert_eq!(located("a.dsp", 3, "oops").to_string(), "a.dsp:3: oops");
+        assert_eq!(ScriptError::without_location("oops").to_string(), "oops");
+    }
+}
@@ -0,0 +1,226 @@
+//! Coalescing of redundant MIDI control messages within a block
+//!
+//! Each CC (or pitch bend, aftertouch...) received by the DSP ends up as a
+//! dated update of a timed zone, and timed_dsp splits the computation of the
+//! block at each of them. A controller streaming at a high rate can thus send
+//! dozens of messages per block for the same zone, most of them overwritten a
+//! few samples later. This bounds the control work per block, whatever the
+//! rate of the inputs.
+//!
+//! All the MIDI messages of a block are queued in arrival order until the
+//! block is computed. A message of a continuous controller replaces the
+//! previous one for the same controller in the same time slot, unless a
+//! message whose order matters came in between. These are:
+//!
+//! - notes, program changes and other channel voice messages,
+//! - switch pedals (sustain, sostenuto...), whose every toggle counts,
+//! - channel mode messages (all notes off...), which act on the notes,
+//! - bank select, (N)RPN selection and data entry, which only make sense as a
+//!   sequence.
+//!
+//! Continuous controllers act on distinct zones, so the relative order of
+//! messages of different controllers doesn't matter.
+//!
+//! Other control sources don't need this: GUI writes go directly to the zones
+//! (so only the last one before a block is seen), and smoothers already limit
+//! themselves to a few updates per block.
+
+/// How many messages can be queued during a block. When it is full, the
+/// queue is forwarded right away
+const MAX_PENDING: usize = 256;
+
+#[derive(Debug)]
+struct Pending {
+    /// Status byte and, for messages that have one, the controller number.
+    /// None for messages that can't be coalesced
+    key: Option<(u8, u8)>,
+    slot: u32,
+    timestamp: f64,
+    midi_data: [u8; 3],
+}
+
+#[derive(Debug)]
+pub(crate) struct ControlCompactor {
+    /// Size of the time slots, in samples. 0 disables compaction
+    resolution: u32,
+    pending: Vec<Pending>,
+}
+
+/// Identifies the controller of the messages that can be coalesced
+fn continuous_key(midi_data: [u8; 3]) -> Option<(u8, u8)> {
+    let status = midi_data[0];
+    match status & 0xF0 {
+        0xB0 => match midi_data[1] {
+            // Bank select, data entry, pedals, (N)RPN selection and channel
+            // mode messages
+            0 | 6 | 32 | 38 | 64..=69 | 96..=101 | 120..=127 => None,
+            cc => Some((status, cc)),
+        },
+        // Polyphonic aftertouch: per note
+        0xA0 => Some((status, midi_data[1])),
+        // Channel aftertouch and pitch bend: per channel
+        0xD0 | 0xE0 => Some((status, 0)),
+        _ => None,
+    }
+}
+
+impl ControlCompactor {
+    pub(crate) fn new(resolution: u32) -> Self {
+        Self {
+            resolution,
+            pending: Vec::with_capacity(MAX_PENDING),
+        }
+    }
+
+    pub(crate) fn set_resolution(&mut self, resolution: u32) {
+        self.resolution = resolution;
+    }
+
+    /// Queues the message, coalescing it with a previous one if possible.
+    /// `send` forwards messages to the DSP, in case they can't be queued
+    pub(crate) fn push(
+        &mut self,
+        timestamp: f64,
+        midi_data: [u8; 3],
+        mut send: impl FnMut(f64, [u8; 3]),
+    ) {
+        if self.resolution == 0 {
+            self.flush(&mut send);
+            send(timestamp, midi_data);
+            return;
+        }
+        let key = continuous_key(midi_data);
+        let slot = timestamp.max(0.0) as u32 / self.resolution;
+        if key.is_some() {
+            // Messages come in time order, so a match is most likely near the
+            // end. It can't be moved past a message whose order matters
+            for p in self.pending.iter_mut().rev() {
+                match p.key {
+                    None => break,
+                    Some(_) if p.key == key => {
+                        if p.slot == slot {
+                            p.timestamp = timestamp;
+                            p.midi_data = midi_data;
+                            return;
+                        }
+                        break;
+                    }
+                    Some(_) => {}
+                }
+            }
+        }
+        if self.pending.len() >= MAX_PENDING {
+            self.flush(&mut send);
+        }
+        self.pending.push(Pending {
+            key,
+            slot,
+            timestamp,
+            midi_data,
+        });
+    }
+
+    /// Forwards the queued messages in order, to be called right before
+    /// computing the block
+    pub(crate) fn flush(&mut self, mut send: impl FnMut(f64, [u8; 3])) {
+        for p in self.pending.drain(..) {
+            send(p.timestamp, p.midi_data);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const NOTE_ON: u8 = 0x90;
+    const CC: u8 = 0xB0;
+
+    /// Pushes (timestamp, message) pairs, and returns what reaches the DSP
+    fn run(resolution: u32, msgs: &[(f64, [u8; 3])]) -> Vec<[u8; 3]> {
+        let mut compactor = ControlCompactor::new(resolution);
+        let mut sent = vec![];
+        for &(timestamp, midi_data) in msgs {
+            compactor.push(timestamp, midi_data, |_, m| sent.push(m));
+        }
+        compactor.flush(|_, m| sent.push(m));
+        sent
+    }
+
+    #[test]
+    fn coalesces_a_stream_of_the_same_controller() {
+        let msgs: Vec<_> = (0..32).map(|i| (i as f64, [CC, 1, i])).collect();
+        assert_eq!(run(32, &msgs), vec![[CC, 1, 31]]);
+        assert_eq!(run(16, &msgs), vec![[CC, 1, 15], [CC, 1, 31]]);
+        assert_eq!(run(0, &msgs).len(), 32);
+    }
+
+    #[test]
+    fn coalesces_interleaved_controllers() {
+        let msgs = [
+            (0.0, [CC, 1, 10]),
+            (1.0, [CC, 2, 20]),
+            (2.0, [CC, 1, 11]),
+            (3.0, [0xE0, 0, 64]),
+            (4.0, [CC, 2, 21]),
+        ];
+        assert_eq!(
+            run(32, &msgs),
+            vec![[CC, 1, 11], [CC, 2, 21], [0xE0, 0, 64]]
+        );
+    }
+
+    #[test]
+    fn all_notes_off_keeps_its_place() {
+        let msgs = [(0.0, [CC, 123, 0]), (0.0, [NOTE_ON, 60, 100])];
+        assert_eq!(run(32, &msgs), vec![[CC, 123, 0], [NOTE_ON, 60, 100]]);
+        let msgs = [(0.0, [NOTE_ON, 60, 100]), (1.0, [CC, 120, 0])];
+        assert_eq!(run(32, &msgs), vec![[NOTE_ON, 60, 100], [CC, 120, 0]]);
+    }
+
+    #[test]
+    fn sustain_toggles_are_all_kept_in_order() {
+        let msgs = [
+            (0.0, [CC, 64, 127]),
+            (1.0, [0x80, 60, 0]),
+            (2.0, [CC, 64, 0]),
+            (3.0, [CC, 64, 127]),
+        ];
+        let expected: Vec<_> = msgs.iter().map(|(_, m)| *m).collect();
+        assert_eq!(run(32, &msgs), expected);
+    }
+
+    #[test]
+    fn bank_select_keeps_its_place() {
+        let msgs = [
+            (0.0, [CC, 0, 1]),
+            (0.0, [CC, 32, 2]),
+            (0.0, [0xC0, 5, 0]),
+            (1.0, [CC, 0, 3]),
+            (1.0, [CC, 32, 4]),
+            (1.0, [0xC0, 6, 0]),
+        ];
+        let expected: Vec<_> = msgs.iter().map(|(_, m)| *m).collect();
+        assert_eq!(run(32, &msgs), expected);
+    }
+
+    #[test]
+    fn controllers_are_not_moved_across_notes() {
+        let msgs = [
+            (0.0, [CC, 1, 10]),
+            (1.0, [NOTE_ON, 60, 100]),
+            (2.0, [CC, 1, 11]),
+        ];
+        let expected: Vec<_> = msgs.iter().map(|(_, m)| *m).collect();
+        assert_eq!(run(32, &msgs), expected);
+    }
+
+    #[test]
+    fn full_queue_is_forwarded_in_order() {
+        let msgs: Vec<_> = (0..MAX_PENDING + 10)
+            .map(|i| (0.0, [NOTE_ON, (i % 128) as u8, 100]))
+            .collect();
+        let expected: Vec<_> = msgs.iter().map(|(_, m)| *m).collect();
+        assert_eq!(run(32, &msgs), expected);
+    }
+}
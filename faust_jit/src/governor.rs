@@ -0,0 +1,228 @@
+//! Graceful degradation of polyphony when blocks get too expensive to compute
+
+use std::{
+    sync::{
+        atomic::{AtomicBool, AtomicU32, Ordering},
+        Mutex,
+    },
+    time::Duration,
+};
+
+/// How many held notes can be tracked. Notes received when that many are
+/// already held are forwarded but never stolen
+const MAX_TRACKED_NOTES: usize = 128;
+
+#[derive(Debug, Clone, Copy)]
+/// Settings of the load governor of a [`crate::SingletonDsp`]
+///
+/// The load of a block is the time spent computing it divided by the duration
+/// of the audio it contains, so 1.0 means the DSP barely keeps up with real
+/// time
+pub struct GovernorConfig {
+    /// Load above which a block counts as being under pressure
+    pub high_load: f32,
+    /// Load below which a block counts as having headroom
+    pub low_load: f32,
+    /// How many consecutive blocks under pressure before the voice limit is
+    /// lowered by one
+    pub blocks_before_degrading: u32,
+    /// How many consecutive blocks with headroom before the voice limit is
+    /// raised by one
+    pub blocks_before_restoring: u32,
+    /// The voice limit will never go below that
+    pub min_voices: u32,
+}
+
+impl Default for GovernorConfig {
+    fn default() -> Self {
+        Self {
+            high_load: 0.8,
+            low_load: 0.5,
+            blocks_before_degrading: 4,
+            blocks_before_restoring: 200,
+            min_voices: 1,
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+/// What the governor is currently doing
+pub struct GovernorStatus {
+    /// The load of the last computed block
+    pub load: f32,
+    /// The max number of notes currently allowed to be held, if the governor
+    /// had to limit it
+    pub voice_limit: Option<u32>,
+}
+
+#[derive(Debug)]
+struct GovernorState {
+    config: Option<GovernorConfig>,
+    /// (channel, pitch) of the currently held notes, oldest first
+    held_notes: Vec<(u8, u8)>,
+    pressured_blocks: u32,
+    relaxed_blocks: u32,
+}
+
+#[derive(Debug)]
+/// Watches the cost of each block and limits the number of held notes (by
+/// stealing the oldest ones) when the DSP is under pressure. Quality is
+/// restored one voice at a time when headroom comes back, the gap between
+/// `high_load` and `low_load` and the block counters acting as hysteresis.
+///
+/// Faust voices don't expose their level, so the oldest held note is used as
+/// the best guess for the least audible one.
+pub(crate) struct Governor {
+    /// Only ever locked by the audio thread, so it never waits for it
+    state: Mutex<GovernorState>,
+    /// A config set by another thread, that the audio thread has yet to apply
+    /// to `state`. The audio thread only try_locks it
+    new_config: Mutex<Option<Option<GovernorConfig>>>,
+    has_new_config: AtomicBool,
+    /// Whether `state` has a config, so blocks don't lock it when the governor
+    /// is off
+    enabled: AtomicBool,
+    /// u32::MAX means no limit
+    voice_limit: AtomicU32,
+    /// The bits of an f32
+    load: AtomicU32,
+}
+
+impl Governor {
+    pub(crate) fn new() -> Self {
+        Self {
+            state: Mutex::new(GovernorState {
+                config: None,
+                held_notes: Vec::with_capacity(MAX_TRACKED_NOTES),
+                pressured_blocks: 0,
+                relaxed_blocks: 0,
+            }),
+            new_config: Mutex::new(None),
+            has_new_config: AtomicBool::new(false),
+            enabled: AtomicBool::new(false),
+            voice_limit: AtomicU32::new(u32::MAX),
+            load: AtomicU32::new(0),
+        }
+    }
+
+    /// Takes effect at the next MIDI event or block
+    pub(crate) fn set_config(&self, config: Option<GovernorConfig>) {
+        *self.new_config.lock().unwrap() = Some(config);
+        self.has_new_config.store(true, Ordering::Release);
+    }
+
+    /// Locks the state, applying the config set by [`Self::set_config`] if
+    /// there is one
+    fn state(&self) -> std::sync::MutexGuard<'_, GovernorState> {
+        let mut state = self.state.lock().unwrap();
+        if self.has_new_config.load(Ordering::Acquire) {
+            if let Ok(mut new_config) = self.new_config.try_lock() {
+                if let Some(config) = new_config.take() {
+                    self.enabled.store(config.is_some(), Ordering::Relaxed);
+                    state.config = config;
+                    state.pressured_blocks = 0;
+                    state.relaxed_blocks = 0;
+                    self.voice_limit.store(u32::MAX, Ordering::Relaxed);
+                }
+                self.has_new_config.store(false, Ordering::Relaxed);
+            }
+        }
+        state
+    }
+
+    pub(crate) fn status(&self) -> GovernorStatus {
+        let limit = self.voice_limit.load(Ordering::Relaxed);
+        GovernorStatus {
+            load: f32::from_bits(self.load.load(Ordering::Relaxed)),
+            voice_limit: if limit == u32::MAX { None } else { Some(limit) },
+        }
+    }
+
+    /// Tracks note on/off messages, and steals the oldest held note when a new
+    /// one would exceed the voice limit. `send` forwards messages to the DSP
+    pub(crate) fn on_midi(&self, midi_data: [u8; 3], mut send: impl FnMut([u8; 3])) {
+        let mut state = self.state();
+        if state.config.is_some() {
+            let status = midi_data[0] & 0xF0;
+            let channel = midi_data[0] & 0x0F;
+            let note = (channel, midi_data[1]);
+            if status == 0x90 && midi_data[2] > 0 {
+                let limit = self.voice_limit.load(Ordering::Relaxed) as usize;
+                while state.held_notes.len() >= limit.max(1) {
+                    let (ch, pitch) = state.held_notes.remove(0);
+                    send([0x80 | ch, pitch, 0]);
+                }
+                if state.held_notes.len() < MAX_TRACKED_NOTES {
+                    state.held_notes.push(note);
+                }
+            } else if status == 0x80 || status == 0x90 {
+                state.held_notes.retain(|n| *n != note);
+            }
+        }
+        send(midi_data);
+    }
+
+    /// To be called after each block has been computed. Notes stolen because
+    /// of a lowered voice limit are sent to the DSP via `send` and will be
+    /// released at the beginning of the next block
+    pub(crate) fn after_block(
+        &self,
+        compute_time: Duration,
+        block_duration: Duration,
+        mut send: impl FnMut([u8; 3]),
+    ) {
+        let load = compute_time.as_secs_f32() / block_duration.as_secs_f32();
+        self.load.store(load.to_bits(), Ordering::Relaxed);
+        if !self.enabled.load(Ordering::Relaxed) && !self.has_new_config.load(Ordering::Acquire) {
+            return;
+        }
+
+        let mut guard = self.state();
+        let state = &mut *guard;
+        let Some(config) = &state.config else {
+            return;
+        };
+        let limit = self.voice_limit.load(Ordering::Relaxed);
+        if load > config.high_load {
+            state.relaxed_blocks = 0;
+            state.pressured_blocks += 1;
+            if state.pressured_blocks >= config.blocks_before_degrading {
+                state.pressured_blocks = 0;
+                // The first limit starts from what is actually playing, so the
+                // first degradation step is effective. After that, it goes down
+                // one voice at a time, even if fewer notes are held (e.g. when
+                // the load comes from release tails):
+                let current = if limit == u32::MAX {
+                    state.held_notes.len() as u32
+                } else {
+                    limit
+                };
+                // With no note held, there is nothing to steal:
+                if current == 0 {
+                    return;
+                }
+                let new_limit = (current - 1).max(config.min_voices);
+                self.voice_limit.store(new_limit, Ordering::Relaxed);
+                while state.held_notes.len() > new_limit as usize {
+                    let (ch, pitch) = state.held_notes.remove(0);
+                    send([0x80 | ch, pitch, 0]);
+                }
+            }
+        } else if load < config.low_load && limit != u32::MAX {
+            state.pressured_blocks = 0;
+            state.relaxed_blocks += 1;
+            if state.relaxed_blocks >= config.blocks_before_restoring {
+                state.relaxed_blocks = 0;
+                let new_limit = if limit as usize >= MAX_TRACKED_NOTES {
+                    u32::MAX
+                } else {
+                    limit + 1
+                };
+                self.voice_limit.store(new_limit, Ordering::Relaxed);
+            }
+        } else {
+            state.pressured_blocks = 0;
+            state.relaxed_blocks = 0;
+        }
+    }
+}
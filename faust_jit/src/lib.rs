@@ -6,6 +6,15 @@
 //! - [`DspWidget`], that gives a description of the UI that should be created
 //!   from that DSP, and gives mutable access to the internal parameters of the
 //!   DSP.
+//! - [`Factory`], to compile a script once and create several [`SingletonDsp`]s
+//!   from it.
+//! - [`check_script`], to quickly find the errors of a script without
+//!   compiling it.
+//! - [`GovernorConfig`], to make a [`SingletonDsp`] reduce its polyphony when
+//!   it gets too expensive to compute in real time.
+//! - [`recording`], to record what a [`SingletonDsp`] is fed and replay it
+//!   later.
+//! - [`ab`], to run two builds of a DSP side by side and compare them.
 //!
 //! This crates takes care of the faust specifics to handle both effect &
 //! instrument (poly or mono) DSPs, as well as passing MIDI events to the DSP
@@ -17,21 +26,43 @@
 use std::{
     cell::RefCell,
     ffi::{c_char, c_void, CStr, CString},
+    net::SocketAddr,
     path::Path,
     ptr::null_mut,
     sync::{
-        atomic::{AtomicBool, AtomicPtr, Ordering},
-        Mutex, RwLock,
+        atomic::{AtomicBool, AtomicPtr, AtomicU64, Ordering},
+        Arc, Mutex, RwLock,
     },
+    time::{Duration, Instant},
 };
 
 use wrapper::*;
 
+use compaction::ControlCompactor;
+use governor::Governor;
+use osc::OscEndpoint;
+use smoothing::ZoneSmoother;
+use watchdog::Watchdog;
+
 pub use cache::*;
+pub use check::{check_script, ScriptError};
+pub use governor::{GovernorConfig, GovernorStatus};
+pub use smoothing::{Smoothing, SmoothingShape};
+pub use target::MachineTarget;
+pub use watchdog::{BypassReason, WatchdogConfig};
 pub use widgets::*;
 pub use wrapper::DspInfo;
 
+pub mod ab;
 mod cache;
+mod check;
+mod compaction;
+mod governor;
+mod osc;
+pub mod recording;
+mod smoothing;
+mod target;
+mod watchdog;
 mod widgets;
 mod wrapper;
 
@@ -82,6 +113,115 @@ impl DspLoadMode {
     }
 }
 
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+/// How the memory of a DSP instance (delay lines, tables...) is allocated. It
+/// always comes directly from the OS as zeroed pages, so creating the
+/// instance doesn't need to clear it
+pub enum DspMemory {
+    /// Pages only become resident when the DSP first touches them, so only
+    /// the parts it actually writes cost RAM (e.g. a 10-second delay line
+    /// used for 1 second costs 1 second). But the first blocks computed take
+    /// the page faults, so this is for rendering offline
+    Lazy,
+    /// All pages are made resident when the instance is created, on the
+    /// thread creating it, so computing it doesn't page fault
+    #[default]
+    Prefaulted,
+    /// Same, and the pages are also locked in RAM, so they can't be swapped
+    /// out later. The OS may refuse to lock more than a few MB, in which case
+    /// they are just prefaulted
+    Locked,
+}
+
+impl DspMemory {
+    fn to_wrapper(self) -> WDspMemory {
+        match self {
+            Self::Lazy => WDspMemory::MEMORY_LAZY,
+            Self::Prefaulted => WDspMemory::MEMORY_PREFAULTED,
+            Self::Locked => WDspMemory::MEMORY_LOCKED,
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+/// How much LLVM optimizes the code Faust generates. The optimization passes
+/// are most of the compile time of large scripts
+pub enum OptLevel {
+    /// The highest level, which Faust uses by default
+    #[default]
+    Full,
+    /// LLVM's level 1: several times faster to compile for large scripts, for
+    /// code that is usually somewhat slower. Meant to iterate quickly on a
+    /// script, before compiling it at [`OptLevel::Full`]
+    Quick,
+}
+
+impl OptLevel {
+    /// As given to libfaust
+    fn llvm_level(&self) -> i32 {
+        match self {
+            OptLevel::Full => -1,
+            OptLevel::Quick => 1,
+        }
+    }
+}
+
+#[derive(Debug, Clone, Default, PartialEq)]
+/// Options given to the Faust compiler when creating a DSP factory. They are
+/// part of the key identifying a factory in the [`Cache`]
+///
+/// Faust's parallel code generation (`-sch`, `-omp`) is not offered, as its
+/// LLVM backend has no parallel code container. Nor are its approximations of
+/// the libm functions (`-fm def`): the code generated with them calls the
+/// `fast_*` functions of Faust's `fastmath.cpp`, which only the C++ backend
+/// compiles in, so the JIT has nothing to link them with
+pub struct CompileOptions {
+    /// Which CPU the code is generated for. Native builds are keyed in the
+    /// cache by CPU and CPU features, so a cache can be shared by machines
+    pub target: MachineTarget,
+    pub opt_level: OptLevel,
+}
+
+impl CompileOptions {
+    /// What is hashed along with the script to get its cache key
+    fn cache_salt(&self) -> String {
+        // Starts with a space, where the Faust arguments of removed options
+        // used to be, so that the keys of existing builds are unchanged
+        let mut salt = String::from(" target=");
+        salt.push_str(&self.target.cache_key());
+        // Always there, so that the builds cached before the target and opt
+        // level were part of the factory key (which libfaust uses to give
+        // back a live factory instead of the cached one) are not read anymore
+        salt.push_str(&format!(" opt={}", self.opt_level.llvm_level()));
+        salt
+    }
+
+    fn cache_id(&self, script_path: &Path) -> Result<CacheId, String> {
+        // We are not including import_paths in the hash as it takes too
+        // long too hash. Improve this later
+        Cache::hash_input_with_salt(script_path, &[], &self.cache_salt()).map_err(|e| e.to_string())
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+/// How much of the real-time budget of a core a DSP needs (1.0 meaning a whole
+/// core), as measured by [`SingletonDsp::warm_up`]
+pub struct CostEstimate {
+    /// The load with no note held, or the load of an effect
+    pub idle_load: f32,
+    /// What each held note adds to it (0 for effects)
+    pub voice_load: f32,
+    /// How many notes can be held at once (0 for effects)
+    pub nvoices: i32,
+}
+
+impl CostEstimate {
+    /// The load when every voice is playing
+    pub fn full_load(&self) -> f32 {
+        self.idle_load + self.voice_load * self.nvoices as f32
+    }
+}
+
 #[derive(Debug)]
 /// RAII interface to faust DSP factories and instances
 pub struct SingletonDsp {
@@ -89,6 +229,22 @@ pub struct SingletonDsp {
     /// The factory pointer is kept around only to be deallocated when its time
     /// to drop the SingletonDsp
     factory: AtomicPtr<WFactory>,
+    /// When created with [`Self::from_factory`]. Only dropped after the
+    /// instance has been deleted
+    shared_factory: Option<Arc<Factory>>,
+    /// As given when creating the instance, to create similar ones
+    nvoices: i32,
+    /// Unique among all the SingletonDsps of the process
+    id: u64,
+    /// The interactive parameters, with their paths. Their order is the one
+    /// of [`Self::param_paths`]
+    params: Vec<widgets::ParamPath>,
+    /// The values of the params after the last block, so that a
+    /// [`recording::SessionRecorder`] can tell the values written since then
+    /// (by the GUI, the host, OSC...) from the ones the DSP wrote itself (MIDI
+    /// mappings, smoothing). Only kept up to date once a recorder asks for it
+    param_values: Mutex<Vec<f32>>,
+    track_param_values: AtomicBool,
     /// The DSP instance is mutex-protected, as we don't want its compute
     /// function being called by two threads at the same time
     instance: Mutex<AtomicPtr<WDsp>>,
@@ -99,6 +255,26 @@ pub struct SingletonDsp {
     /// contained inside the WDsp object).
     widgets: RwLock<Vec<DspWidget<&'static mut f32>>>,
     chan_ptrs: ChanPtrs,
+    /// One for each parameter that declares a `[smooth:xxx]` metadata
+    smoothers: Mutex<Vec<ZoneSmoother>>,
+    /// Whether `smoothers` is not empty, so the blocks of most DSPs don't lock
+    /// it
+    has_smoothers: bool,
+    /// MIDI control messages held back until the next block
+    compactor: Mutex<ControlCompactor>,
+    /// Whether messages were pushed to the compactor since the last flush
+    midi_pending: AtomicBool,
+    /// Whether MIDI messages were passed to the DSP since the last block. They
+    /// may have queued dated zone updates, which only the timed_dsp layer
+    /// applies
+    timed_events: AtomicBool,
+    osc: Mutex<Option<OscEndpoint>>,
+    /// Set by the network thread of `osc` when there are updates to apply
+    osc_pending: Arc<AtomicBool>,
+    governor: Governor,
+    watchdog: Watchdog,
+    /// Set by [`Self::warm_up`]
+    cost_estimate: Mutex<Option<CostEstimate>>,
     /// Tells the sample rate and how many input & output audio channels this
     /// DSP expects
     pub info: DspInfo,
@@ -108,6 +284,8 @@ pub struct SingletonDsp {
 
 impl Drop for SingletonDsp {
     fn drop(&mut self) {
+        *self.osc.get_mut().unwrap() = None;
+        self.smoothers.get_mut().unwrap().clear();
         unsafe {
             let instance = self.instance.get_mut().unwrap().get_mut();
             if !instance.is_null() {
@@ -125,6 +303,34 @@ impl Drop for SingletonDsp {
     }
 }
 
+#[derive(Debug)]
+/// A compiled script, from which any number of [`SingletonDsp`]s can be
+/// created with [`SingletonDsp::from_factory`]. They all share its machine
+/// code, so running several instances of a script compiles it only once
+pub struct Factory(AtomicPtr<WFactory>);
+
+impl Factory {
+    /// Compiles a script (or reads it from the cache). See
+    /// [`SingletonDsp::from_file`]
+    pub fn from_file(
+        opt_cache: Option<&Cache>,
+        script_path: &Path,
+        import_paths: &[&Path],
+        options: &CompileOptions,
+    ) -> Result<Self, String> {
+        load_engine()?;
+        load_factory(opt_cache, script_path, import_paths, options)
+            .map(|ptr| Self(AtomicPtr::new(ptr)))
+    }
+}
+
+impl Drop for Factory {
+    fn drop(&mut self) {
+        unsafe { w_deleteDSPFactory(*self.0.get_mut()) };
+    }
+}
+
+#[derive(Debug, Clone)]
 /// Data needed to generate a MIDI clock for the DSP
 pub struct ClockData {
     /// The tempo (as given by the host)
@@ -145,12 +351,28 @@ impl SingletonDsp {
         Self {
             transport_already_playing: AtomicBool::new(false),
             factory: AtomicPtr::new(null_mut()),
+            shared_factory: None,
+            nvoices: -1,
+            id: NEXT_DSP_ID.fetch_add(1, Ordering::Relaxed),
+            params: vec![],
+            param_values: Mutex::new(vec![]),
+            track_param_values: AtomicBool::new(false),
             instance: Mutex::new(AtomicPtr::new(null_mut())),
             uis: AtomicPtr::new(null_mut()),
             widgets: RwLock::new(vec![]),
             chan_ptrs: ChanPtrs {
                 vec: RefCell::new(vec![]),
             },
+            smoothers: Mutex::new(vec![]),
+            has_smoothers: false,
+            compactor: Mutex::new(ControlCompactor::new(1)),
+            midi_pending: AtomicBool::new(false),
+            timed_events: AtomicBool::new(false),
+            cost_estimate: Mutex::new(None),
+            osc: Mutex::new(None),
+            osc_pending: Arc::new(AtomicBool::new(false)),
+            governor: Governor::new(),
+            watchdog: Watchdog::new(),
             info: DspInfo {
                 sample_rate: 0,
                 num_inputs: 0,
@@ -159,58 +381,21 @@ impl SingletonDsp {
         }
     }
 
-    fn add_factory(
+    fn add_instance(
         &mut self,
-        opt_cache: Option<&Cache>,
-        script_path: &Path,
-        import_paths: &[&Path],
-    ) -> Result<(), String> {
-        let mut error_msg_buf = [0; 4096];
-        let fac_ptr = match opt_cache {
-            Some(cache) => {
-                // We are not including import_paths in the hash as it takes too
-                // long too hash. Improve this later
-                let res_id = Cache::hash_input(script_path, &[]).map_err(|e| e.to_string())?;
-                match cache.query(res_id) {
-                    CacheQueryResult::Hit(folder) => unsafe {
-                        w_readFactoryFromFolder(
-                            path_to_cstring(&folder)?.as_ptr(),
-                            error_msg_buf.as_mut_ptr(),
-                        )
-                    },
-                    CacheQueryResult::Miss(writer) => {
-                        let fac_ptr =
-                            new_factory_from_file(script_path, import_paths, &mut error_msg_buf)?;
-                        writer.with_dest_folder(|folder| {
-                            unsafe {
-                                w_writeFactoryToFolder(fac_ptr, path_to_cstring(folder)?.as_ptr());
-                            };
-                            Ok::<_, String>(fac_ptr)
-                        })?
-                    }
-                }
-            }
-            None => new_factory_from_file(script_path, import_paths, &mut error_msg_buf)?,
-        };
-        if fac_ptr.is_null() {
-            let error_msg = unsafe { CStr::from_ptr(error_msg_buf.as_ptr()) };
-            Err(error_msg
-                .to_str()
-                .map_err(|s| format!("Could not parse Faust err msg as utf8: {}", s))?
-                .to_string())
-        } else {
-            *self.factory.get_mut() = fac_ptr;
-            Ok(())
-        }
-    }
-
-    fn add_instance(&mut self, sample_rate: i32, load_mode: &DspLoadMode) {
+        factory: *mut WFactory,
+        sample_rate: i32,
+        load_mode: &DspLoadMode,
+        memory: DspMemory,
+    ) {
+        self.nvoices = load_mode.to_nvoices();
         *self.instance.get_mut().unwrap().get_mut() = unsafe {
             w_createDSPInstance(
-                *self.factory.get_mut(),
+                factory,
                 sample_rate,
                 load_mode.to_nvoices(),
                 false,
+                memory.to_wrapper(),
             )
         };
     }
@@ -225,9 +410,21 @@ impl SingletonDsp {
             w_createUIs(
                 inst_ptr,
                 (&mut widgets_builder) as *mut DspWidgetsBuilder as *mut c_void,
+                Some(rs_declare_widget),
+                Some(rs_declare_metadata),
             )
         };
         widgets_builder.build_widgets(self.widgets.get_mut().unwrap());
+        widgets::param_paths(self.widgets.get_mut().unwrap(), "", &mut self.params);
+        *self.param_values.get_mut().unwrap() = vec![f32::NAN; self.params.len()];
+
+        let mut smoothed_zones = vec![];
+        widgets::smoothed_zones(self.widgets.get_mut().unwrap(), &mut smoothed_zones);
+        *self.smoothers.get_mut().unwrap() = smoothed_zones
+            .into_iter()
+            .map(|(zone, smoothing)| ZoneSmoother::new(inst_ptr, zone, smoothing))
+            .collect();
+        self.has_smoothers = !self.smoothers.get_mut().unwrap().is_empty();
     }
 
     /// Load a faust .dsp file and initialize the DSP
@@ -237,21 +434,73 @@ impl SingletonDsp {
     ///
     /// Can use a file-based [`Cache`] to store the LLVM bytecode to save time when
     /// reloading the same DSP in a future execution. IMPORTANT: That cache
-    /// takes into account only the contents of the script, NOT what it imports
+    /// takes into account only the contents of the script and the compile
+    /// options, NOT what the script imports
+    ///
+    /// `memory` tells how the memory of the instance is allocated: the
+    /// default suits real-time use
     pub fn from_file(
         opt_cache: Option<&Cache>,
         script_path: &Path,
         import_paths: &[&Path],
+        options: &CompileOptions,
         sample_rate: i32,
         load_mode: &DspLoadMode,
+        memory: DspMemory,
     ) -> Result<Self, String> {
+        load_engine()?;
         let mut dsp = Self::new_empty();
-        dsp.add_factory(opt_cache, script_path, import_paths)?;
-        dsp.add_instance(sample_rate, load_mode);
+        let factory = load_factory(opt_cache, script_path, import_paths, options)?;
+        *dsp.factory.get_mut() = factory;
+        dsp.add_instance(factory, sample_rate, load_mode, memory);
         dsp.add_info_and_uis();
         Ok(dsp)
     }
 
+    /// Whether [`Self::from_file`] would find the factory in the cache, and
+    /// thus load quickly. Like for [`Self::from_file`], what the script imports
+    /// is not taken into account
+    pub fn is_cached(
+        cache: &Cache,
+        script_path: &Path,
+        options: &CompileOptions,
+    ) -> Result<bool, String> {
+        load_engine()?;
+        Ok(cache.contains(&options.cache_id(script_path)?))
+    }
+
+    /// Compiles a script and stores its factory in the cache (unless it's
+    /// already there), without creating any DSP instance. This is how packs of
+    /// precompiled scripts are built (see [`Cache::with_read_only_layers`])
+    pub fn compile_to_cache(
+        cache: &Cache,
+        script_path: &Path,
+        import_paths: &[&Path],
+        options: &CompileOptions,
+    ) -> Result<(), String> {
+        Factory::from_file(Some(cache), script_path, import_paths, options).map(|_| ())
+    }
+
+    /// Creates a new instance of an already compiled script. The
+    /// [`SingletonDsp`] keeps the factory alive as long as it needs it
+    pub fn from_factory(
+        factory: &Arc<Factory>,
+        sample_rate: i32,
+        load_mode: &DspLoadMode,
+        memory: DspMemory,
+    ) -> Self {
+        let mut dsp = Self::new_empty();
+        dsp.add_instance(
+            factory.0.load(Ordering::Relaxed),
+            sample_rate,
+            load_mode,
+            memory,
+        );
+        dsp.add_info_and_uis();
+        dsp.shared_factory = Some(Arc::clone(factory));
+        dsp
+    }
+
     /// Creates a SingletonDsp from an already created `dsp_poly_factory` (the
     /// Faust C++ class).
     ///
@@ -263,7 +512,8 @@ impl SingletonDsp {
     ///
     /// This allows to use [`SingletonDsp`] and [`DspWidget`] with DSPs/DSP
     /// factories obtained from other means than llvm JIT compilation (for
-    /// instance a DSP compiled statically with faust2rust).
+    /// instance a DSP compiled statically with faust2rust). `memory` is
+    /// ignored for such factories, which keep their own memory manager.
     ///
     /// IMPORTANT: If your application already defines the faust static
     /// variables `std::list<GUI *> GUI::fGuiList` and `ztimedmap
@@ -274,16 +524,18 @@ impl SingletonDsp {
         owns_factory: bool,
         sample_rate: i32,
         load_mode: &DspLoadMode,
-    ) -> Self {
+        memory: DspMemory,
+    ) -> Result<Self, String> {
+        load_engine()?;
         let mut dsp = Self::new_empty();
         *dsp.factory.get_mut() = factory_ptr;
-        dsp.add_instance(sample_rate, load_mode);
+        dsp.add_instance(factory_ptr, sample_rate, load_mode, memory);
         dsp.add_info_and_uis();
         if !owns_factory {
             // We don't own the factory and therefore don't keep its pointer
             *dsp.factory.get_mut() = null_mut();
         }
-        dsp
+        Ok(dsp)
     }
 
     /// Creates a [`SingletonDsp`] from an already created instance of a
@@ -295,12 +547,15 @@ impl SingletonDsp {
     /// [`SingletonDsp`] goes out of scope, so you may NOT use the dsp pointer
     /// after calling this function
     ///
-    /// See [`Self::from_poly_factory_ptr`] doc for more information.
-    pub fn from_dsp_ptr(dsp_ptr: *mut WDsp) -> Self {
+    /// See [`Self::from_poly_factory_ptr`] doc for more information. Fails
+    /// only if the engine cannot be loaded, in which case `dsp_ptr` is left
+    /// untouched
+    pub fn from_dsp_ptr(dsp_ptr: *mut WDsp) -> Result<Self, String> {
+        load_engine()?;
         let mut dsp = Self::new_empty();
         *dsp.instance.get_mut().unwrap().get_mut() = dsp_ptr;
         dsp.add_info_and_uis();
-        dsp
+        Ok(dsp)
     }
 
     /// If another thread is currently calling [`Self::with_widgets_mut`], this
@@ -315,16 +570,191 @@ impl SingletonDsp {
         f(&mut *self.widgets.write().unwrap())
     }
 
+    /// Sets the parameters of this DSP to the values they have in `other`,
+    /// matching them by their path of labels. Meant to be used when replacing a
+    /// DSP by another build of the same script
+    pub fn copy_params_from(&self, other: &SingletonDsp) {
+        other.with_widgets(|from| self.with_widgets_mut(|to| widgets::copy_values(from, to)));
+    }
+
+    /// The paths of labels of the interactive parameters (e.g.
+    /// `/synth/filter/cutoff`), as used for OSC
+    pub fn param_paths(&self) -> Vec<String> {
+        self.params.iter().map(|p| p.path.clone()).collect()
+    }
+
+    /// Sets the parameter at `index` in [`Self::param_paths`], clamping the
+    /// value to its range
+    pub fn set_param(&self, index: usize, value: f32) {
+        if let Some(p) = self.params.get(index) {
+            unsafe { *p.zone = value.clamp(p.min, p.max) };
+        }
+    }
+
     /// To be called for each midi event for the current audio buffer
     ///
     /// See [`Self::process_buffers`] for more info
     pub fn handle_raw_midi(&self, timestamp: f64, midi_data: [u8; 3]) {
         let uis = self.uis.load(Ordering::Relaxed);
-        unsafe {
-            w_handleRawMidi(uis, timestamp, midi_data.as_ptr());
+        self.compactor
+            .lock()
+            .unwrap()
+            .push(timestamp, midi_data, |timestamp, bytes| {
+                self.forward_midi(uis, timestamp, bytes)
+            });
+        self.midi_pending.store(true, Ordering::Relaxed);
+    }
+
+    /// Passes to the DSP the messages held by the compactor, if any
+    fn flush_midi(&self, uis: *mut WUIs) {
+        if self.midi_pending.swap(false, Ordering::Relaxed) {
+            self.compactor
+                .lock()
+                .unwrap()
+                .flush(|timestamp, bytes| self.forward_midi(uis, timestamp, bytes));
+        }
+    }
+
+    /// Passes a message that went through the compactor to the DSP
+    fn forward_midi(&self, uis: *mut WUIs, timestamp: f64, midi_data: [u8; 3]) {
+        self.governor
+            .on_midi(midi_data, |bytes| self.send_midi(uis, timestamp, bytes));
+    }
+
+    fn send_midi(&self, uis: *mut WUIs, timestamp: f64, midi_data: [u8; 3]) {
+        self.timed_events.store(true, Ordering::Relaxed);
+        unsafe { w_handleRawMidi(uis, timestamp, midi_data.as_ptr()) };
+    }
+
+    /// Within a block, MIDI control messages (CC, pitch bend, aftertouch) for
+    /// the same continuous controller that fall in the same slot of
+    /// `resolution` samples are coalesced, only the last one being passed to
+    /// the DSP. Notes, pedals and other messages whose order matters are never
+    /// coalesced nor reordered. The default is 1, which only drops messages
+    /// that would be overwritten at the very same sample. 0 disables
+    /// coalescing
+    pub fn set_control_resolution(&self, resolution: u32) {
+        self.compactor.lock().unwrap().set_resolution(resolution);
+    }
+
+    /// Starts listening for OSC messages on a UDP port of localhost (0 to let
+    /// the OS pick a free one), replacing the previous endpoint if any.
+    /// Parameters are addressed by their path of labels (e.g.
+    /// `/synth/filter/cutoff`), with the characters that are not allowed in
+    /// OSC addresses replaced by `_`. Returns the address that is listened on
+    pub fn start_osc(&self, port: u16) -> Result<SocketAddr, String> {
+        // Frees the port first, in case it's the same:
+        self.stop_osc();
+        let endpoint =
+            OscEndpoint::start(port, self.params.clone(), Arc::clone(&self.osc_pending))?;
+        let addr = endpoint.local_addr();
+        let previous = self.osc.lock().unwrap().replace(endpoint);
+        drop(previous);
+        Ok(addr)
+    }
+
+    pub fn stop_osc(&self) {
+        // Stopping the network thread can take a while, so it's done once the
+        // audio thread can access the endpoint again:
+        let endpoint = self.osc.lock().unwrap().take();
+        drop(endpoint);
+    }
+
+    /// Where OSC messages are listened for, if [`Self::start_osc`] was called
+    pub fn osc_address(&self) -> Option<SocketAddr> {
+        self.osc.lock().unwrap().as_ref().map(|o| o.local_addr())
+    }
+
+    /// Enables (or disables, with None) the watchdog, which bypasses the DSP
+    /// (fading it out) after too many blocks that either contain NaN or
+    /// infinite samples or took way longer than usual to compute. See
+    /// [`WatchdogConfig`]
+    pub fn set_watchdog(&self, opt_config: Option<WatchdogConfig>) {
+        self.watchdog.set_config(opt_config);
+    }
+
+    /// Why the DSP is currently bypassed by the watchdog, if it is
+    pub fn bypass_reason(&self) -> Option<BypassReason> {
+        self.watchdog.bypass_reason()
+    }
+
+    /// Null for DSPs created from a bare DSP pointer
+    fn factory_ptr(&self) -> *mut WFactory {
+        match &self.shared_factory {
+            Some(shared) => shared.0.load(Ordering::Relaxed),
+            None => self.factory.load(Ordering::Relaxed),
         }
     }
 
+    /// Whether both DSPs run the very same machine code, i.e. they are
+    /// instances of the same build. libfaust gives back a live build when
+    /// asked for one with the same script and options
+    pub fn shares_code_with(&self, other: &SingletonDsp) -> bool {
+        unsafe { w_shareDSPCode(self.factory_ptr(), other.factory_ptr()) }
+    }
+
+    /// Clears the internal state of the DSP (delay lines, filters... that may
+    /// contain NaNs), and resumes computing it if the watchdog had bypassed it
+    pub fn reset(&self) {
+        let dsp = self.instance.lock().unwrap();
+        unsafe { w_clearDSP(dsp.load(Ordering::Relaxed)) };
+        self.watchdog.reset();
+    }
+
+    /// Computes `blocks` blocks of silence with a scratch instance of the same
+    /// factory (holding a note during the second half, for instruments). Meant
+    /// to be called on a background thread before the DSP goes live, so that
+    /// its first audible blocks don't pay for cold caches and lazily resolved
+    /// JIT code. This instance itself is left untouched: to also avoid page
+    /// faults on its memory, see [`DspMemory`]. Returns None for
+    /// DSPs created from a bare DSP pointer
+    ///
+    /// Part of the blocks are timed, which gives an estimate of the cost of the
+    /// DSP (also available afterwards with [`Self::cost_estimate`]). It is
+    /// measured on silence and with a single note, so scripts whose cost
+    /// depends on their input or on the number of notes in a non-linear way
+    /// may cost more. At least 8 blocks are needed for it to be meaningful
+    pub fn warm_up(&self, block_size: usize, blocks: usize) -> Option<CostEstimate> {
+        let factory = self.factory_ptr();
+        if factory.is_null() {
+            return None;
+        }
+        let cost = unsafe {
+            w_warmUpFactory(
+                factory,
+                self.info.sample_rate,
+                self.nvoices,
+                block_size as i32,
+                blocks as i32,
+            )
+        };
+        let ns_to_load = self.info.sample_rate as f64 / 1e9;
+        let estimate = CostEstimate {
+            idle_load: (cost.idle_ns * ns_to_load) as f32,
+            voice_load: (cost.voice_ns * ns_to_load) as f32,
+            nvoices: cost.nvoices,
+        };
+        *self.cost_estimate.lock().unwrap() = Some(estimate);
+        Some(estimate)
+    }
+
+    /// What the last call to [`Self::warm_up`] measured
+    pub fn cost_estimate(&self) -> Option<CostEstimate> {
+        *self.cost_estimate.lock().unwrap()
+    }
+
+    /// Enables (or disables, with None) the load governor, which will lower the
+    /// number of notes that can be held at the same time when the blocks take
+    /// too long to compute. See [`GovernorConfig`]
+    pub fn set_governor(&self, opt_config: Option<GovernorConfig>) {
+        self.governor.set_config(opt_config);
+    }
+
+    /// The load of the last computed block, and the current voice limit
+    pub fn governor_status(&self) -> GovernorStatus {
+        self.governor.status()
+    }
+
     /// Generate a MIDI clock and MIDI start/stop messages, and send them to the
     /// DSP
     ///
@@ -339,6 +769,7 @@ impl SingletonDsp {
         if playing {
             if !already_playing {
                 unsafe { w_handleMidiSync(uis, 0.0, WMidiSyncMsg::MIDI_START) };
+                self.timed_events.store(true, Ordering::Relaxed);
                 self.transport_already_playing
                     .store(true, Ordering::Relaxed);
             }
@@ -356,12 +787,14 @@ impl SingletonDsp {
                     unsafe {
                         w_handleMidiSync(uis, next_pulse_pos as f64, WMidiSyncMsg::MIDI_CLOCK)
                     };
+                    self.timed_events.store(true, Ordering::Relaxed);
                     next_pulse_pos += samples_per_pulse;
                 }
             }
         } else {
             if already_playing {
                 unsafe { w_handleMidiSync(uis, 0.0, WMidiSyncMsg::MIDI_STOP) };
+                self.timed_events.store(true, Ordering::Relaxed);
                 self.transport_already_playing
                     .store(false, Ordering::Relaxed);
             }
@@ -381,7 +814,16 @@ impl SingletonDsp {
     ///     ignored (ie. will stay untouched)
     ///   - if audio_bufs contains LESS channels, this function will panic
     pub fn process_buffers(&self, audio_bufs: &mut [&mut [f32]]) {
-        unsafe { w_updateAllGuis() };
+        let uis = self.uis.load(Ordering::Relaxed);
+        // The UIs of the instance only reflect zone changes to its MIDI layer,
+        // which has no output, so they are only updated on blocks with MIDI
+        // messages. Only the UIs of this instance, so instances can be
+        // processed by different threads at once:
+        let had_midi =
+            self.midi_pending.load(Ordering::Relaxed) || self.timed_events.load(Ordering::Relaxed);
+        if had_midi {
+            unsafe { w_updateGuis(uis) };
+        }
 
         // First thing to do is to lock the DSP:
         let dsp = self.instance.lock().unwrap();
@@ -390,21 +832,106 @@ impl SingletonDsp {
         for i in 0..ptr_vec.len() {
             ptr_vec[i] = audio_bufs[i].as_mut_ptr()
         }
+        if self.watchdog.is_bypassed() {
+            let num_outputs = self.info.num_outputs as usize;
+            for buf in audio_bufs.iter_mut().take(num_outputs) {
+                buf.fill(0.0);
+            }
+            drop(dsp);
+            // Messages received in the meantime still reach the DSP, so a
+            // note off or sustain off isn't lost:
+            self.skip_block();
+            return;
+        }
+        // Each of these only takes its lock if it has something to do, so an
+        // event-free block only locks the instance:
+        self.flush_midi(uis);
+        self.apply_osc();
+        let mut smoothing = false;
+        if self.has_smoothers {
+            for smoother in self.smoothers.lock().unwrap().iter_mut() {
+                smoothing |= smoother.before_block(self.info.sample_rate, samples as usize);
+            }
+        }
+        // Most blocks of an effect have no dated update at all. These skip
+        // the timed layer, which otherwise walks the timed zones of the DSP to
+        // slice the block. Direct writes to zones (GUI, OSC, host params)
+        // are seen by both paths
+        let timed = self.timed_events.swap(false, Ordering::Relaxed) || smoothing;
+        let start = Instant::now();
         unsafe {
-            w_computeDSP(dsp.load(Ordering::Relaxed), samples, ptr_vec.as_mut_ptr());
+            let dsp = dsp.load(Ordering::Relaxed);
+            if timed {
+                w_computeDSP(dsp, samples, ptr_vec.as_mut_ptr());
+            } else {
+                w_computeDSPDirect(dsp, samples, ptr_vec.as_mut_ptr());
+            }
+        }
+        let elapsed = start.elapsed();
+        let block_duration =
+            Duration::from_secs_f64(samples as f64 / self.info.sample_rate.max(1) as f64);
+        let num_outputs = self.info.num_outputs as usize;
+        // Both return right away when disabled:
+        self.watchdog
+            .after_block(elapsed, block_duration, &mut audio_bufs[..num_outputs]);
+        self.governor.after_block(elapsed, block_duration, |bytes| {
+            self.send_midi(uis, 0.0, bytes)
+        });
+        self.store_param_values();
+    }
+
+    /// Takes in what the DSP was sent for the current block, without computing
+    /// it: notes still start and stop, and controllers jump to their last
+    /// value, instead of piling up for the next computed block
+    pub(crate) fn skip_block(&self) {
+        let uis = self.uis.load(Ordering::Relaxed);
+        self.flush_midi(uis);
+        self.apply_osc();
+        let dsp = self.instance.lock().unwrap();
+        unsafe { w_skipDSPBlock(dsp.load(Ordering::Relaxed)) };
+        self.timed_events.store(false, Ordering::Relaxed);
+        self.store_param_values();
+    }
+
+    /// Writes the parameter values received via OSC to their zones
+    pub(crate) fn apply_osc(&self) {
+        if !self.osc_pending.swap(false, Ordering::Relaxed) {
+            return;
+        }
+        // OSC messages are applied at the next block if the endpoint is being
+        // replaced:
+        match self.osc.try_lock() {
+            Ok(mut osc) => {
+                if let Some(osc) = osc.as_mut() {
+                    osc.apply_received();
+                }
+            }
+            Err(_) => self.osc_pending.store(true, Ordering::Relaxed),
+        }
+    }
+
+    fn store_param_values(&self) {
+        if !self.track_param_values.load(Ordering::Relaxed) {
+            return;
+        }
+        let mut values = self.param_values.lock().unwrap();
+        for (value, param) in values.iter_mut().zip(&self.params) {
+            *value = unsafe { *param.zone };
         }
     }
 }
 
-fn new_factory_from_file(
+static NEXT_DSP_ID: AtomicU64 = AtomicU64::new(0);
+
+/// The script path and the arguments telling the Faust compiler where to look
+/// for imports
+fn script_args(
     script_path: &Path,
     import_paths: &[&Path],
-    error_msg_buf: &mut [c_char; 4096],
-) -> Result<*mut WFactory, String> {
+) -> Result<(CString, Vec<CString>), String> {
     let script_parent_folder = script_path
         .parent()
         .ok_or("Parent folder of script couldn't be found")?;
-    let script_path = path_to_cstring(script_path)?;
     let mut args = vec![
         c"--in-place".to_owned(),
         c"-I".to_owned(),
@@ -414,12 +941,79 @@ fn new_factory_from_file(
         args.push(c"-I".to_owned());
         args.push(path_to_cstring(folder)?);
     }
+    Ok((path_to_cstring(script_path)?, args))
+}
+
+fn load_factory(
+    opt_cache: Option<&Cache>,
+    script_path: &Path,
+    import_paths: &[&Path],
+    options: &CompileOptions,
+) -> Result<*mut WFactory, String> {
+    let mut error_msg_buf = [0; 4096];
+    let target = options.target.llvm_target();
+    let fac_ptr = match opt_cache {
+        Some(cache) => match cache.query(options.cache_id(script_path)?) {
+            CacheQueryResult::Hit(folder) => unsafe {
+                w_readFactoryFromFolder(
+                    path_to_cstring(&folder)?.as_ptr(),
+                    target.as_ptr(),
+                    error_msg_buf.as_mut_ptr(),
+                )
+            },
+            CacheQueryResult::Miss(writer) => {
+                let fac_ptr =
+                    new_factory_from_file(script_path, import_paths, options, &mut error_msg_buf)?;
+                // Nothing is written to the cache for a script that failed:
+                if fac_ptr.is_null() {
+                    return Err(faust_error(&error_msg_buf));
+                }
+                writer.with_dest_folder(|folder| {
+                    unsafe {
+                        w_writeFactoryToFolder(
+                            fac_ptr,
+                            path_to_cstring(folder)?.as_ptr(),
+                            target.as_ptr(),
+                        );
+                    };
+                    Ok::<_, String>(fac_ptr)
+                })?
+            }
+        },
+        None => new_factory_from_file(script_path, import_paths, options, &mut error_msg_buf)?,
+    };
+    if fac_ptr.is_null() {
+        Err(faust_error(&error_msg_buf))
+    } else {
+        unsafe { w_setDSPMemory(fac_ptr) };
+        Ok(fac_ptr)
+    }
+}
+
+/// The error message libfaust wrote in `error_msg_buf`
+fn faust_error(error_msg_buf: &[c_char; 4096]) -> String {
+    let error_msg = unsafe { CStr::from_ptr(error_msg_buf.as_ptr()) };
+    match error_msg.to_str() {
+        Ok(msg) => msg.to_string(),
+        Err(e) => format!("Could not parse Faust err msg as utf8: {}", e),
+    }
+}
+
+fn new_factory_from_file(
+    script_path: &Path,
+    import_paths: &[&Path],
+    options: &CompileOptions,
+    error_msg_buf: &mut [c_char; 4096],
+) -> Result<*mut WFactory, String> {
+    let (script_path, args) = script_args(script_path, import_paths)?;
     let mut args_ptrs: Vec<_> = args.iter().map(|cstring| cstring.as_ptr()).collect();
     Ok(unsafe {
         w_createDSPFactoryFromFile(
             script_path.as_ptr(),
             args_ptrs.len() as i32,
             args_ptrs.as_mut_ptr(),
+            options.target.llvm_target().as_ptr(),
+            options.opt_level.llvm_level(),
             error_msg_buf.as_mut_ptr(),
         )
     })
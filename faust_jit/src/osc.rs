@@ -0,0 +1,370 @@
+//! A local OSC endpoint, to control the parameters of a DSP at full float
+//! resolution
+//!
+//! Parameters are addressed by their path of labels, like in Faust's own OSC
+//! address space (e.g. `/synth/filter/cutoff`). Packets are decoded on a
+//! network thread, which resolves addresses to parameter indices and sends the
+//! new values through a bounded queue. The audio thread applies them at the
+//! beginning of each block, all the values of a same message or bundle being
+//! applied in the same block. OSC time tags are ignored.
+
+use super::widgets::ParamPath;
+use std::{
+    collections::HashMap,
+    net::{SocketAddr, UdpSocket},
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        mpsc::{sync_channel, Receiver, SyncSender, TrySendError},
+        Arc,
+    },
+    thread::JoinHandle,
+    time::Duration,
+};
+
+/// How many updates can wait in the queue between the network thread and the
+/// audio thread
+const QUEUE_SIZE: usize = 4096;
+
+/// How many updates the audio thread holds while waiting for the end of a
+/// bundle. A bundle bigger than that is applied over several blocks
+const MAX_STAGED_UPDATES: usize = 4096;
+
+/// How often the network thread checks whether it should stop. Kept short as
+/// the endpoint is dropped along with its DSP, possibly while the audio thread
+/// waits for it
+const POLL_INTERVAL: Duration = Duration::from_millis(20);
+
+#[derive(Debug, Clone, Copy)]
+struct Update {
+    param: u32,
+    value: f32,
+    /// Whether this is the last update of a packet (message or bundle), and
+    /// thus if the updates received so far can be applied
+    end_of_packet: bool,
+}
+
+#[derive(Debug)]
+struct Zone {
+    ptr: *mut f32,
+    min: f32,
+    max: f32,
+}
+
+#[derive(Debug)]
+pub(crate) struct OscEndpoint {
+    local_addr: SocketAddr,
+    receiver: Receiver<Update>,
+    zones: Vec<Zone>,
+    /// Updates received by the audio thread but whose packet is not complete
+    staged: Vec<Update>,
+    stop: Arc<AtomicBool>,
+    thread: Option<JoinHandle<()>>,
+}
+
+// The zone pointers are only dereferenced while the SingletonDsp they belong
+// to is alive, and only by the thread that computes the DSP. The endpoint is
+// kept behind a mutex, so it doesn't need to be Sync
+unsafe impl Send for OscEndpoint {}
+
+impl OscEndpoint {
+    /// Listens on localhost. Port 0 lets the OS pick a free port. `pending` is
+    /// set by the network thread whenever it queues updates, so the audio
+    /// thread only needs to look at the queue when it is set (staged updates
+    /// wait for the end of their packet, which sets it again)
+    pub(crate) fn start(
+        port: u16,
+        params: Vec<ParamPath>,
+        pending: Arc<AtomicBool>,
+    ) -> Result<Self, String> {
+        let socket = UdpSocket::bind(("127.0.0.1", port)).map_err(|e| e.to_string())?;
+        socket
+            .set_read_timeout(Some(POLL_INTERVAL))
+            .map_err(|e| e.to_string())?;
+        let local_addr = socket.local_addr().map_err(|e| e.to_string())?;
+        let index: HashMap<String, u32> = params
+            .iter()
+            .enumerate()
+            .map(|(i, p)| (p.path.clone(), i as u32))
+            .collect();
+        let (sender, receiver) = sync_channel(QUEUE_SIZE);
+        let stop = Arc::new(AtomicBool::new(false));
+        let thread = std::thread::Builder::new()
+            .name("faust-jit-osc".into())
+            .spawn({
+                let (pending, stop) = (Arc::clone(&pending), Arc::clone(&stop));
+                move || receive_loop(socket, index, sender, pending, stop)
+            })
+            .map_err(|e| e.to_string())?;
+        Ok(Self {
+            local_addr,
+            receiver,
+            zones: params
+                .into_iter()
+                .map(|p| Zone {
+                    ptr: p.zone,
+                    min: p.min,
+                    max: p.max,
+                })
+                .collect(),
+            staged: Vec::with_capacity(MAX_STAGED_UPDATES),
+            stop,
+            thread: Some(thread),
+        })
+    }
+
+    pub(crate) fn local_addr(&self) -> SocketAddr {
+        self.local_addr
+    }
+
+    /// Writes to the zones the values of all the packets fully received so
+    /// far. To be called by the audio thread right before computing a block
+    pub(crate) fn apply_received(&mut self) {
+        while self.staged.len() < MAX_STAGED_UPDATES {
+            match self.receiver.try_recv() {
+                Ok(update) => self.staged.push(update),
+                Err(_) => break,
+            }
+        }
+        let complete = if self.staged.len() >= MAX_STAGED_UPDATES {
+            self.staged.len()
+        } else {
+            self.staged
+                .iter()
+                .rposition(|u| u.end_of_packet)
+                .map_or(0, |i| i + 1)
+        };
+        for update in self.staged.drain(..complete) {
+            let zone = &self.zones[update.param as usize];
+            unsafe { *zone.ptr = update.value.clamp(zone.min, zone.max) };
+        }
+    }
+}
+
+impl Drop for OscEndpoint {
+    fn drop(&mut self) {
+        self.stop.store(true, Ordering::Relaxed);
+        if let Some(thread) = self.thread.take() {
+            let _ = thread.join();
+        }
+    }
+}
+
+fn receive_loop(
+    socket: UdpSocket,
+    index: HashMap<String, u32>,
+    sender: SyncSender<Update>,
+    pending: Arc<AtomicBool>,
+    stop: Arc<AtomicBool>,
+) {
+    let mut buf = vec![0u8; 65536];
+    let mut updates = vec![];
+    while !stop.load(Ordering::Relaxed) {
+        let len = match socket.recv(&mut buf) {
+            Ok(len) => len,
+            // Timeouts (so we can check for stop), or e.g. ICMP errors
+            // reported on Windows. The socket is still usable
+            Err(_) => continue,
+        };
+        updates.clear();
+        decode_packet(&buf[..len], &index, &mut updates);
+        if let Some(last) = updates.last_mut() {
+            last.end_of_packet = true;
+        }
+        for &update in &updates {
+            // If the audio thread doesn't keep up (or the DSP isn't being
+            // computed at all), we wait, while still checking for stop
+            let mut update = update;
+            loop {
+                match sender.try_send(update) {
+                    Ok(()) => {
+                        pending.store(true, Ordering::Relaxed);
+                        break;
+                    }
+                    Err(TrySendError::Full(u)) if !stop.load(Ordering::Relaxed) => {
+                        update = u;
+                        std::thread::sleep(Duration::from_millis(1));
+                    }
+                    Err(_) => return,
+                }
+            }
+        }
+    }
+}
+
+fn decode_packet(data: &[u8], index: &HashMap<String, u32>, out: &mut Vec<Update>) {
+    if let Some(mut elems) = data.strip_prefix(b"#bundle\0") {
+        // Skipping the time tag:
+        elems = elems.get(8..).unwrap_or_default();
+        while let Some(size) = read_i32(elems, 0) {
+            let Some(elem) = elems.get(4..4 + size.max(0) as usize) else {
+                return;
+            };
+            decode_packet(elem, index, out);
+            elems = &elems[4 + elem.len()..];
+        }
+    } else if let Some(update) = decode_message(data, index) {
+        out.push(update);
+    }
+}
+
+/// Only the first argument of a message is used, as all parameters take a
+/// single value
+fn decode_message(data: &[u8], index: &HashMap<String, u32>) -> Option<Update> {
+    let (address, pos) = read_padded_str(data, 0)?;
+    let param = *index.get(address)?;
+    let (type_tags, pos) = read_padded_str(data, pos)?;
+    let value = match type_tags.strip_prefix(',')?.chars().next()? {
+        'f' => f32::from_bits(read_i32(data, pos)? as u32),
+        'i' => read_i32(data, pos)? as f32,
+        'd' => f64::from_bits(read_i64(data, pos)? as u64) as f32,
+        'h' => read_i64(data, pos)? as f32,
+        'T' => 1.0,
+        'F' => 0.0,
+        _ => return None,
+    };
+    value.is_finite().then_some(Update {
+        param,
+        value,
+        end_of_packet: false,
+    })
+}
+
+/// Returns the string and the position after its padding
+fn read_padded_str(data: &[u8], pos: usize) -> Option<(&str, usize)> {
+    let rest = data.get(pos..)?;
+    let len = rest.iter().position(|&b| b == 0)?;
+    let s = std::str::from_utf8(&rest[..len]).ok()?;
+    Some((s, pos + (len + 4) / 4 * 4))
+}
+
+fn read_i32(data: &[u8], pos: usize) -> Option<i32> {
+    Some(i32::from_be_bytes(data.get(pos..pos + 4)?.try_into().ok()?))
+}
+
+fn read_i64(data: &[u8], pos: usize) -> Option<i64> {
+    Some(i64::from_be_bytes(data.get(pos..pos + 8)?.try_into().ok()?))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn pad(bytes: &mut Vec<u8>) {
+        bytes.push(0);
+        while bytes.len() % 4 != 0 {
+            bytes.push(0);
+        }
+    }
+
+    fn message(address: &str, type_tags: &str, args: &[u8]) -> Vec<u8> {
+        let mut bytes = address.as_bytes().to_vec();
+        pad(&mut bytes);
+        bytes.extend_from_slice(type_tags.as_bytes());
+        pad(&mut bytes);
+        bytes.extend_from_slice(args);
+        bytes
+    }
+
+    fn bundle(elems: &[Vec<u8>]) -> Vec<u8> {
+        let mut bytes = b"#bundle\0".to_vec();
+        bytes.extend_from_slice(&1u64.to_be_bytes());
+        for elem in elems {
+            bytes.extend_from_slice(&(elem.len() as i32).to_be_bytes());
+            bytes.extend_from_slice(elem);
+        }
+        bytes
+    }
+
+    fn index() -> HashMap<String, u32> {
+        [("/gain", 0), ("/synth/cutoff", 1)]
+            .into_iter()
+            .map(|(path, i)| (path.to_owned(), i))
+            .collect()
+    }
+
+    /// The (param, value) pairs decoded from a packet
+    fn decode(data: &[u8]) -> Vec<(u32, f32)> {
+        let mut out = vec![];
+        decode_packet(data, &index(), &mut out);
+        out.iter().map(|u| (u.param, u.value)).collect()
+    }
+
+    #[test]
+    fn decodes_messages() {
+        let cases = [
+            (message("/gain", ",f", &0.5f32.to_be_bytes()), 0.5),
+            (message("/gain", ",i", &(-3i32).to_be_bytes()), -3.0),
+            (message("/gain", ",d", &0.25f64.to_be_bytes()), 0.25),
+            (message("/gain", ",h", &7i64.to_be_bytes()), 7.0),
+            (message("/gain", ",T", &[]), 1.0),
+            (message("/gain", ",F", &[]), 0.0),
+            // Only the first argument is used:
+            (message("/gain", ",fs", &2.0f32.to_be_bytes()), 2.0),
+        ];
+        for (data, value) in cases {
+            assert_eq!(decode(&data), vec![(0, value)]);
+        }
+        let cutoff = message("/synth/cutoff", ",f", &440.0f32.to_be_bytes());
+        assert_eq!(decode(&cutoff), vec![(1, 440.0)]);
+    }
+
+    #[test]
+    fn ignores_unusable_messages() {
+        let one = 1.0f32.to_be_bytes();
+        assert!(decode(&message("/unknown", ",f", &one)).is_empty());
+        assert!(decode(&message("/gain", ",s", b"abc\0")).is_empty());
+        assert!(decode(&message("/gain", "f", &one)).is_empty());
+        assert!(decode(&message("/gain", ",", &[])).is_empty());
+        assert!(decode(&message("/gain", ",f", &f32::NAN.to_be_bytes())).is_empty());
+        assert!(decode(&message("/gain", ",d", &f64::MAX.to_be_bytes())).is_empty());
+    }
+
+    #[test]
+    fn decodes_nested_bundles() {
+        let gain = |v: f32| message("/gain", ",f", &v.to_be_bytes());
+        let cutoff = message("/synth/cutoff", ",i", &100i32.to_be_bytes());
+        let data = bundle(&[
+            gain(0.1),
+            bundle(&[cutoff, bundle(&[]), gain(0.2)]),
+            gain(0.3),
+        ]);
+        assert_eq!(
+            decode(&data),
+            vec![(0, 0.1), (1, 100.0), (0, 0.2), (0, 0.3)]
+        );
+    }
+
+    #[test]
+    fn ignores_truncated_or_malformed_packets() {
+        let full = message("/gain", ",f", &0.5f32.to_be_bytes());
+        // Every truncation of a message, down to an empty packet:
+        for len in 0..full.len() {
+            assert!(decode(&full[..len]).is_empty(), "{} bytes", len);
+        }
+        // An address that is not null-terminated, or not UTF-8:
+        assert!(decode(b"/gain").is_empty());
+        let mut bad_utf8 = full.clone();
+        bad_utf8[1] = 0xFF;
+        assert!(decode(&bad_utf8).is_empty());
+
+        // Bundles stop at the first element that overflows the packet, keeping
+        // the ones before it:
+        let data = bundle(&[full.clone(), full.clone()]);
+        assert_eq!(decode(&data[..data.len() - 1]), vec![(0, 0.5)]);
+        let mut data = bundle(&[full.clone()]);
+        data.extend_from_slice(&1000i32.to_be_bytes());
+        data.extend_from_slice(&full);
+        assert_eq!(decode(&data), vec![(0, 0.5)]);
+        // A negative size is an empty element:
+        let mut data = bundle(&[]);
+        data.extend_from_slice(&(-8i32).to_be_bytes());
+        data.extend_from_slice(&(full.len() as i32).to_be_bytes());
+        data.extend_from_slice(&full);
+        assert_eq!(decode(&data), vec![(0, 0.5)]);
+        // A bundle cut in its header or time tag:
+        let data = bundle(&[full]);
+        for len in 0..16 {
+            assert!(decode(&data[..len]).is_empty(), "{} bytes", len);
+        }
+    }
+}
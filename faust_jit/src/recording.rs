@@ -0,0 +1,518 @@
+//! Recording of everything a [`SingletonDsp`] is fed (input audio, MIDI,
+//! transport, parameter changes and block sizes), to replay it later against
+//! any build of any script
+//!
+//! The audio thread writes records into preallocated chunks, which are handed
+//! to a writer thread when full and given back once written. If the writer
+//! can't keep up and no free chunk is left, the recording stops there (a
+//! replay must see every block to be faithful), which can be checked with
+//! [`SessionRecorder::overflowed`]. Another thread (e.g. a GUI) starts and
+//! stops recordings through a [`recorder_channel`], so the audio thread never
+//! waits for it and records every block.
+//!
+//! The recorded parameter changes are the values written to the parameters
+//! between two blocks, by the GUI, the host or OSC (OSC messages are applied
+//! when the block is recorded). The values the DSP writes itself during a
+//! block (MIDI mappings, smoothing ramps) are not, as the replay computes them
+//! again from the recorded MIDI.
+//!
+//! The file starts with a header (magic, sample rate, nvoices), followed by
+//! little-endian records, each one starting with a tag byte. Parameters are
+//! identified by their path of labels, so that a recording still applies to a
+//! modified script. A replay is bit-exact with the same script and options if
+//! the recording started right after the DSP was loaded (or reset), as the
+//! internal state of the DSP is not recorded, and if the load governor did
+//! not cut any voice.
+
+use super::{widgets::ParamPath, ClockData, SingletonDsp};
+use std::{
+    fs::File,
+    io::{BufReader, BufWriter, Read, Write},
+    path::Path,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        mpsc::{sync_channel, Receiver, SyncSender},
+        Arc, Mutex,
+    },
+    thread::JoinHandle,
+};
+
+const MAGIC: &[u8; 8] = b"FJREC\0\0\x01";
+
+/// Size of the chunks the audio thread writes into
+const CHUNK_SIZE: usize = 256 * 1024;
+
+/// How many chunks are allocated upfront. 16MB, which is about 40 seconds of
+/// stereo audio at 48kHz, gives the writer thread plenty of slack
+const NUM_CHUNKS: usize = 64;
+
+/// Parameters after that many are not recorded
+const MAX_PARAMS: usize = 4096;
+
+/// How many recordings can be started or stopped before the audio thread
+/// takes them into account
+const MAX_COMMANDS: usize = 4;
+
+const TAG_PARAM_TABLE: u8 = 1;
+const TAG_PARAM: u8 = 2;
+const TAG_MIDI: u8 = 3;
+const TAG_TRANSPORT: u8 = 4;
+const TAG_BLOCK: u8 = 5;
+
+/// The audio thread side of a recording. Dropping it flushes what remains
+/// and finishes the file
+pub struct SessionRecorder {
+    chunk: Vec<u8>,
+    full_sender: Option<SyncSender<Vec<u8>>>,
+    free_receiver: Receiver<Vec<u8>>,
+    writer: Option<JoinHandle<std::io::Result<()>>>,
+    overflowed: Arc<AtomicBool>,
+    /// The DSP whose parameter table was last recorded
+    dsp_id: u64,
+}
+
+impl SessionRecorder {
+    /// Creates the file and starts the writer thread. The sample rate and the
+    /// number of voices (as in [`crate::DspLoadMode::from_nvoices`]) are only
+    /// stored, for the replay to use the same ones
+    pub fn create(path: &Path, sample_rate: i32, nvoices: i32) -> Result<Self, String> {
+        let mut file = BufWriter::new(File::create(path).map_err(|e| e.to_string())?);
+        let header = [
+            &MAGIC[..],
+            &sample_rate.to_le_bytes(),
+            &nvoices.to_le_bytes(),
+        ]
+        .concat();
+        file.write_all(&header).map_err(|e| e.to_string())?;
+
+        let (full_sender, full_receiver) = sync_channel::<Vec<u8>>(NUM_CHUNKS);
+        let (free_sender, free_receiver) = sync_channel(NUM_CHUNKS);
+        for _ in 1..NUM_CHUNKS {
+            free_sender.send(Vec::with_capacity(CHUNK_SIZE)).unwrap();
+        }
+        let writer = std::thread::Builder::new()
+            .name("faust-jit-recorder".into())
+            .spawn(move || {
+                // Ends when the recorder drops its sender
+                for mut chunk in full_receiver {
+                    file.write_all(&chunk)?;
+                    chunk.clear();
+                    let _ = free_sender.try_send(chunk);
+                }
+                file.flush()
+            })
+            .map_err(|e| e.to_string())?;
+        Ok(Self {
+            chunk: Vec::with_capacity(CHUNK_SIZE),
+            full_sender: Some(full_sender),
+            free_receiver,
+            writer: Some(writer),
+            overflowed: Arc::new(AtomicBool::new(false)),
+            dsp_id: u64::MAX,
+        })
+    }
+
+    /// Whether the writer thread couldn't keep up, in which case the recording
+    /// stopped
+    pub fn overflowed(&self) -> bool {
+        self.overflowed.load(Ordering::Relaxed)
+    }
+
+    fn write(&mut self, bytes: &[u8]) {
+        if self.overflowed() {
+            return;
+        }
+        if self.chunk.len() + bytes.len() > self.chunk.capacity() {
+            let Ok(next) = self.free_receiver.try_recv() else {
+                self.overflowed.store(true, Ordering::Relaxed);
+                return;
+            };
+            let full = std::mem::replace(&mut self.chunk, next);
+            if let Some(sender) = &self.full_sender {
+                // Cannot be full, as there are only NUM_CHUNKS chunks
+                let _ = sender.try_send(full);
+            }
+        }
+        // Records are written value by value, so they just span chunks
+        self.chunk.extend_from_slice(bytes);
+    }
+
+    /// To be called before [`SingletonDsp::handle_midi_sync`], with the same
+    /// arguments
+    pub fn record_transport(&mut self, playing: bool, opt_clock_data: &Option<ClockData>) {
+        let (has_clock, tempo, position, size) = match opt_clock_data {
+            Some(c) => (
+                1u8,
+                c.tempo,
+                c.next_buffer_sample_position,
+                c.next_buffer_size,
+            ),
+            None => (0, 0.0, 0, 0),
+        };
+        self.write(&[TAG_TRANSPORT, playing as u8, has_clock]);
+        self.write(&tempo.to_le_bytes());
+        self.write(&position.to_le_bytes());
+        self.write(&(size as u64).to_le_bytes());
+    }
+
+    /// To be called before [`SingletonDsp::handle_raw_midi`], with the same
+    /// arguments
+    pub fn record_midi(&mut self, timestamp: f64, midi_data: [u8; 3]) {
+        self.write(&[TAG_MIDI]);
+        self.write(&timestamp.to_le_bytes());
+        self.write(&midi_data);
+    }
+
+    /// To be called right before [`SingletonDsp::process_buffers`], with the
+    /// same DSP and buffers. Applies the values received via OSC, records the
+    /// parameters written since the last block, then the input audio
+    pub fn record_block(&mut self, dsp: &SingletonDsp, audio_bufs: &[&mut [f32]]) {
+        dsp.apply_osc();
+        let params = &dsp.params[..dsp.params.len().min(MAX_PARAMS)];
+        let new_dsp = dsp.id != self.dsp_id;
+        if new_dsp {
+            self.dsp_id = dsp.id;
+            self.record_param_table(params);
+            dsp.track_param_values.store(true, Ordering::Relaxed);
+        }
+        // Compared with the values the last block left, so that what the DSP
+        // wrote itself is not recorded
+        let mut values = dsp.param_values.lock().unwrap();
+        for (i, (param, last)) in params.iter().zip(values.iter_mut()).enumerate() {
+            let value = unsafe { *param.zone };
+            if new_dsp || value.to_bits() != last.to_bits() {
+                *last = value;
+                self.record_param(i, value);
+            }
+        }
+        drop(values);
+        self.record_audio(audio_bufs);
+    }
+
+    fn record_param(&mut self, index: usize, value: f32) {
+        self.write(&[TAG_PARAM]);
+        self.write(&(index as u32).to_le_bytes());
+        self.write(&value.to_le_bytes());
+    }
+
+    fn record_audio(&mut self, audio_bufs: &[&mut [f32]]) {
+        let num_samples = audio_bufs.first().map_or(0, |b| b.len());
+        self.write(&[TAG_BLOCK]);
+        self.write(&(audio_bufs.len() as u16).to_le_bytes());
+        self.write(&(num_samples as u32).to_le_bytes());
+        for buf in audio_bufs {
+            for s in buf.iter() {
+                self.write(&s.to_le_bytes());
+            }
+        }
+    }
+
+    fn record_param_table(&mut self, params: &[ParamPath]) {
+        self.write(&[TAG_PARAM_TABLE]);
+        self.write(&(params.len() as u32).to_le_bytes());
+        for p in params {
+            self.write(&(p.path.len() as u16).to_le_bytes());
+            self.write(p.path.as_bytes());
+        }
+    }
+}
+
+/// Creates the two ends through which a thread starts and stops the
+/// recordings made by the audio thread
+pub fn recorder_channel() -> (RecorderControl, RecorderSlot) {
+    let (commands_sender, commands) = sync_channel(MAX_COMMANDS);
+    let (finished_sender, finished) = sync_channel(MAX_COMMANDS);
+    (
+        RecorderControl {
+            commands: commands_sender,
+            finished: Mutex::new(finished),
+            overflowed: Mutex::new(None),
+        },
+        RecorderSlot {
+            commands,
+            finished: finished_sender,
+            recorder: None,
+        },
+    )
+}
+
+/// Starts and stops the recordings, from any thread but the audio one
+pub struct RecorderControl {
+    commands: SyncSender<Option<SessionRecorder>>,
+    /// The recorders the audio thread is done with. They are dropped here, as
+    /// finishing their file waits for their writer thread
+    finished: Mutex<Receiver<SessionRecorder>>,
+    /// The overflow flag of the current recording. None when not recording
+    overflowed: Mutex<Option<Arc<AtomicBool>>>,
+}
+
+impl RecorderControl {
+    /// Replaces the current recording, if any
+    pub fn start(&self, recorder: SessionRecorder) -> Result<(), String> {
+        self.collect();
+        let overflowed = Arc::clone(&recorder.overflowed);
+        self.commands
+            .try_send(Some(recorder))
+            .map_err(|_| "Too many recordings started at once".to_string())?;
+        *self.overflowed.lock().unwrap() = Some(overflowed);
+        Ok(())
+    }
+
+    pub fn stop(&self) {
+        self.collect();
+        let mut overflowed = self.overflowed.lock().unwrap();
+        // Still recording if the command can't be queued, so it can be retried
+        if overflowed.is_some() && self.commands.try_send(None).is_ok() {
+            *overflowed = None;
+        }
+    }
+
+    pub fn is_recording(&self) -> bool {
+        self.overflowed.lock().unwrap().is_some()
+    }
+
+    /// Whether the current recording stopped because the disk was too slow
+    pub fn overflowed(&self) -> bool {
+        (self.overflowed.lock().unwrap().as_ref()).is_some_and(|o| o.load(Ordering::Relaxed))
+    }
+
+    /// Finishes the files of the recordings the audio thread has stopped. To
+    /// be called regularly (e.g. at each GUI frame)
+    pub fn collect(&self) {
+        let finished = self.finished.lock().unwrap();
+        while let Ok(recorder) = finished.try_recv() {
+            drop(recorder);
+        }
+    }
+}
+
+/// Holds the current recording on the audio thread
+pub struct RecorderSlot {
+    commands: Receiver<Option<SessionRecorder>>,
+    finished: SyncSender<SessionRecorder>,
+    recorder: Option<SessionRecorder>,
+}
+
+impl RecorderSlot {
+    /// The current recorder, once the recordings started or stopped since the
+    /// last call are taken into account. Never blocks
+    pub fn current(&mut self) -> Option<&mut SessionRecorder> {
+        while let Ok(next) = self.commands.try_recv() {
+            if let Some(previous) = std::mem::replace(&mut self.recorder, next) {
+                // Cannot be full, as the control side collects the finished
+                // recorders before each command
+                let _ = self.finished.try_send(previous);
+            }
+        }
+        self.recorder.as_mut()
+    }
+}
+
+impl Drop for SessionRecorder {
+    fn drop(&mut self) {
+        if let Some(sender) = self.full_sender.take() {
+            if !self.chunk.is_empty() {
+                let _ = sender.send(std::mem::take(&mut self.chunk));
+            }
+        }
+        if let Some(writer) = self.writer.take() {
+            let _ = writer.join();
+        }
+    }
+}
+
+#[derive(Debug)]
+/// What a recording contains, in order
+pub enum SessionEvent {
+    /// The paths of the parameters of the DSP, which [`SessionEvent::Param`]
+    /// refers to by index until the next table
+    ParamTable(Vec<String>),
+    Param {
+        index: usize,
+        value: f32,
+    },
+    Midi {
+        timestamp: f64,
+        midi_data: [u8; 3],
+    },
+    Transport {
+        playing: bool,
+        clock_data: Option<ClockData>,
+    },
+    /// The input audio of a block, one Vec per channel. To be computed once
+    /// the events before it have been passed to the DSP
+    Block(Vec<Vec<f32>>),
+}
+
+/// Reads a file written by a [`SessionRecorder`]
+pub struct SessionReader {
+    file: BufReader<File>,
+    pub sample_rate: i32,
+    pub nvoices: i32,
+}
+
+impl SessionReader {
+    pub fn open(path: &Path) -> Result<Self, String> {
+        let mut file = BufReader::new(File::open(path).map_err(|e| e.to_string())?);
+        let mut header = [0u8; 16];
+        file.read_exact(&mut header)
+            .map_err(|_| "Not a session recording".to_string())?;
+        if &header[..8] != MAGIC {
+            return Err("Not a session recording (or from another version)".into());
+        }
+        Ok(Self {
+            file,
+            sample_rate: i32::from_le_bytes(header[8..12].try_into().unwrap()),
+            nvoices: i32::from_le_bytes(header[12..16].try_into().unwrap()),
+        })
+    }
+
+    fn read<const N: usize>(&mut self) -> Option<[u8; N]> {
+        let mut bytes = [0u8; N];
+        self.file.read_exact(&mut bytes).ok()?;
+        Some(bytes)
+    }
+
+    /// None at the end of the file. A truncated last record (e.g. after an
+    /// overflow) is ignored
+    pub fn next_event(&mut self) -> Result<Option<SessionEvent>, String> {
+        let Some([tag]) = self.read() else {
+            return Ok(None);
+        };
+        Ok(match tag {
+            TAG_PARAM_TABLE => (|| {
+                let count = u32::from_le_bytes(self.read()?);
+                let mut paths = Vec::with_capacity(count as usize);
+                for _ in 0..count {
+                    let len = u16::from_le_bytes(self.read()?) as usize;
+                    let mut bytes = vec![0u8; len];
+                    self.file.read_exact(&mut bytes).ok()?;
+                    paths.push(String::from_utf8_lossy(&bytes).into_owned());
+                }
+                Some(SessionEvent::ParamTable(paths))
+            })(),
+            TAG_PARAM => (|| {
+                Some(SessionEvent::Param {
+                    index: u32::from_le_bytes(self.read()?) as usize,
+                    value: f32::from_le_bytes(self.read()?),
+                })
+            })(),
+            TAG_MIDI => (|| {
+                Some(SessionEvent::Midi {
+                    timestamp: f64::from_le_bytes(self.read()?),
+                    midi_data: self.read()?,
+                })
+            })(),
+            TAG_TRANSPORT => (|| {
+                let [playing, has_clock] = self.read()?;
+                let tempo = f64::from_le_bytes(self.read()?);
+                let position = i64::from_le_bytes(self.read()?);
+                let size = u64::from_le_bytes(self.read()?) as usize;
+                Some(SessionEvent::Transport {
+                    playing: playing != 0,
+                    clock_data: (has_clock != 0).then_some(ClockData {
+                        tempo,
+                        next_buffer_size: size,
+                        next_buffer_sample_position: position,
+                    }),
+                })
+            })(),
+            TAG_BLOCK => (|| {
+                let num_chans = u16::from_le_bytes(self.read()?) as usize;
+                let num_samples = u32::from_le_bytes(self.read()?) as usize;
+                let mut bytes = vec![0u8; num_samples * 4];
+                let mut chans = Vec::with_capacity(num_chans);
+                for _ in 0..num_chans {
+                    self.file.read_exact(&mut bytes).ok()?;
+                    chans.push(
+                        bytes
+                            .chunks_exact(4)
+                            .map(|b| f32::from_le_bytes(b.try_into().unwrap()))
+                            .collect(),
+                    );
+                }
+                Some(SessionEvent::Block(chans))
+            })(),
+            _ => return Err(format!("Unknown record type {} in recording", tag)),
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::ptr::null_mut;
+
+    fn param(path: &str) -> ParamPath {
+        ParamPath {
+            path: path.into(),
+            zone: null_mut(),
+            min: 0.0,
+            max: 1.0,
+        }
+    }
+
+    #[test]
+    fn recording_reads_back() {
+        let path = std::env::temp_dir().join(format!(
+            "faust-jit-recording-test-{}.fjrec",
+            std::process::id()
+        ));
+        let (control, mut slot) = recorder_channel();
+        control
+            .start(SessionRecorder::create(&path, 44100, 8).unwrap())
+            .unwrap();
+        assert!(control.is_recording());
+        let recorder = slot.current().unwrap();
+        recorder.record_transport(
+            true,
+            &Some(ClockData {
+                tempo: 120.0,
+                next_buffer_size: 2,
+                next_buffer_sample_position: 1000,
+            }),
+        );
+        recorder.record_midi(1.0, [0x90, 60, 100]);
+        recorder.record_param_table(&[param("/synth/gain"), param("/synth/cutoff")]);
+        recorder.record_param(1, 0.25);
+        recorder.record_audio(&[&mut [0.5, -0.5], &mut [1.0, f32::MIN_POSITIVE]]);
+        assert!(!recorder.overflowed());
+        control.stop();
+        assert!(!control.is_recording());
+        assert!(slot.current().is_none());
+        // Finishes the file:
+        control.collect();
+
+        let mut reader = SessionReader::open(&path).unwrap();
+        let mut events = vec![];
+        while let Some(event) = reader.next_event().unwrap() {
+            events.push(event);
+        }
+        std::fs::remove_file(&path).unwrap();
+        assert_eq!((reader.sample_rate, reader.nvoices), (44100, 8));
+        assert!(matches!(
+            &events[..],
+            [
+                SessionEvent::Transport {
+                    playing: true,
+                    clock_data: Some(ClockData {
+                        tempo: 120.0,
+                        next_buffer_size: 2,
+                        next_buffer_sample_position: 1000,
+                    }),
+                },
+                SessionEvent::Midi {
+                    timestamp: 1.0,
+                    midi_data: [0x90, 60, 100],
+                },
+                SessionEvent::ParamTable(paths),
+                SessionEvent::Param {
+                    index: 1,
+                    value: 0.25,
+                },
+                SessionEvent::Block(chans),
+            ] if paths == &["/synth/gain", "/synth/cutoff"]
+                && chans == &[vec![0.5, -0.5], vec![1.0, f32::MIN_POSITIVE]]
+        ));
+    }
+}
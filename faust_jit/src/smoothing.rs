@@ -0,0 +1,285 @@
+//! Block-rate smoothing of the zones which declare a `[smooth:xxx]` metadata
+//!
+//! Instead of a per-sample one-pole filter inside the script (like `si.smoo`),
+//! the new value written to a smoothed zone (by the GUI, MIDI...) is turned
+//! into a ramp that is sampled a few times per block, each point being
+//! scheduled as a timed zone update. The timed_dsp wrapper then splits the
+//! computation of the block at these points. The cost of smoothing thus
+//! depends on how often parameters change, not on the number of samples and
+//! voices.
+
+use super::wrapper::*;
+
+/// The ramp of a zone is never updated more often than every that many
+/// samples
+const MIN_STEP_SAMPLES: usize = 16;
+
+/// The ramp of a zone is never updated more often than that many times per
+/// block, so the step size grows with the block size
+const MAX_STEPS_PER_BLOCK: usize = 16;
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+/// How a smoothed zone goes from its current value to a new one
+pub enum SmoothingShape {
+    /// A straight line reaching the new value after the smoothing time
+    Linear,
+    /// A one-pole lowpass, whose time constant is the smoothing time
+    Exponential,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+/// Read from a `[smooth:20]` (linear) or `[smooth:20 exp]` (exponential)
+/// widget metadata, the time being in milliseconds
+pub struct Smoothing {
+    pub time_ms: f32,
+    pub shape: SmoothingShape,
+}
+
+impl Smoothing {
+    pub(crate) fn parse(value: &str) -> Option<Self> {
+        let mut words = value.split_whitespace();
+        let time_ms: f32 = words.next()?.parse().ok()?;
+        let shape = match words.next() {
+            None | Some("lin") => SmoothingShape::Linear,
+            Some("exp") => SmoothingShape::Exponential,
+            _ => return None,
+        };
+        (time_ms > 0.0).then_some(Self { time_ms, shape })
+    }
+}
+
+#[derive(Debug)]
+pub(crate) struct ZoneSmoother {
+    /// The DSP the zone belongs to, whose timed zones it is part of
+    dsp: *mut WDsp,
+    zone: *mut f32,
+    smoothing: Smoothing,
+    /// Whether the zone was registered in the timed zones by us (and should
+    /// thus be unregistered by us)
+    owns_timed_zone: bool,
+    /// The value the zone had after the last block. If it has changed
+    /// since then, someone wrote a new target
+    last_written: f32,
+    /// Where the ramp is at the end of the last block
+    current: f32,
+    target: f32,
+    /// For linear ramps, the per-sample increment
+    slope: f32,
+}
+
+// The zone and DSP pointers are only dereferenced while the SingletonDsp it belongs to
+// is alive, and only by the thread that computes the DSP
+unsafe impl Send for ZoneSmoother {}
+unsafe impl Sync for ZoneSmoother {}
+
+impl ZoneSmoother {
+    pub(crate) fn new(dsp: *mut WDsp, zone: *mut f32, smoothing: Smoothing) -> Self {
+        let owns_timed_zone = unsafe { w_addTimedZone(dsp, zone) };
+        Self::with_timed_zone(dsp, zone, smoothing, owns_timed_zone)
+    }
+
+    fn with_timed_zone(
+        dsp: *mut WDsp,
+        zone: *mut f32,
+        smoothing: Smoothing,
+        owns_timed_zone: bool,
+    ) -> Self {
+        let value = unsafe { *zone };
+        Self {
+            dsp,
+            zone,
+            smoothing,
+            owns_timed_zone,
+            last_written: value,
+            current: value,
+            target: value,
+            slope: 0.0,
+        }
+    }
+
+    /// To be called right before computing a block of `samples` samples.
+    /// Returns whether timed zone updates were scheduled for this block
+    pub(crate) fn before_block(&mut self, sample_rate: i32, samples: usize) -> bool {
+        let (dsp, zone) = (self.dsp, self.zone);
+        self.plan_block(sample_rate, samples, |date, value| unsafe {
+            w_setTimedZoneValue(dsp, zone, date as f64, value)
+        })
+    }
+
+    /// Sets the zone to where the ramp is, and calls `schedule` with the
+    /// (date, value) of the points of the ramp that fall within the block
+    fn plan_block(
+        &mut self,
+        sample_rate: i32,
+        samples: usize,
+        mut schedule: impl FnMut(usize, f32),
+    ) -> bool {
+        let written = unsafe { *self.zone };
+        if written != self.last_written && written != self.target {
+            self.target = written;
+            let ramp_samples = self.smoothing.time_ms * 0.001 * sample_rate as f32;
+            self.slope = (self.target - self.current) / ramp_samples.max(1.0);
+        }
+        // The block starts from where the ramp is, not from the new target nor
+        // from the last point of the previous block:
+        unsafe { *self.zone = self.current };
+        self.last_written = self.current;
+        if self.current == self.target {
+            return false;
+        }
+
+        let step = samples.div_ceil(MAX_STEPS_PER_BLOCK).max(MIN_STEP_SAMPLES);
+        let mut date = 0;
+        let mut scheduled = false;
+        while date + step < samples && self.current != self.target {
+            date += step;
+            self.advance(sample_rate, step);
+            schedule(date, self.current);
+            scheduled = true;
+            // This is what the zone holds once the block is computed:
+            self.last_written = self.current;
+        }
+        // The ramp goes on until the end of the block, even though the zone
+        // will only get there at the beginning of the next one:
+        if self.current != self.target {
+            self.advance(sample_rate, samples - date);
+        }
+        scheduled
+    }
+
+    fn advance(&mut self, sample_rate: i32, samples: usize) {
+        match self.smoothing.shape {
+            SmoothingShape::Linear => {
+                let next = self.current + self.slope * samples as f32;
+                let overshot = (self.slope > 0.0 && next >= self.target)
+                    || (self.slope < 0.0 && next <= self.target);
+                self.current = if overshot { self.target } else { next };
+            }
+            SmoothingShape::Exponential => {
+                let tau_samples = self.smoothing.time_ms * 0.001 * sample_rate as f32;
+                let a = (-(samples as f32) / tau_samples.max(1.0)).exp();
+                self.current = self.target + (self.current - self.target) * a;
+                if (self.current - self.target).abs() <= 1e-4 * self.target.abs().max(1.0) {
+                    self.current = self.target;
+                }
+            }
+        }
+    }
+}
+
+impl Drop for ZoneSmoother {
+    fn drop(&mut self) {
+        if self.owns_timed_zone {
+            unsafe { w_removeTimedZone(self.dsp, self.zone) };
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::ptr::null_mut;
+
+    const SAMPLE_RATE: i32 = 48000;
+
+    /// Runs blocks like the timed_dsp wrapper would, and returns the values
+    /// the zone has at the end of each block
+    fn run_blocks(
+        smoother: &mut ZoneSmoother,
+        zone: &mut f32,
+        samples: usize,
+        blocks: usize,
+    ) -> Vec<f32> {
+        (0..blocks)
+            .map(|_| {
+                let mut points = vec![];
+                smoother.plan_block(SAMPLE_RATE, samples, |date, value| {
+                    points.push((date, value))
+                });
+                assert!(points.iter().all(|(date, _)| *date < samples));
+                if let Some((_, value)) = points.last() {
+                    *zone = *value;
+                }
+                *zone
+            })
+            .collect()
+    }
+
+    fn reaches_target(shape: SmoothingShape, samples: usize) {
+        let mut zone = Box::new(0.0f32);
+        let smoothing = Smoothing {
+            time_ms: 20.0,
+            shape,
+        };
+        let mut smoother = ZoneSmoother::with_timed_zone(null_mut(), &mut *zone, smoothing, false);
+        *zone = 1.0;
+        // 20 ms at 48kHz is 960 samples, and an exponential ramp gets close
+        // enough to its target after about 9 time constants
+        let blocks = 9000 / samples + 2;
+        let values = run_blocks(&mut smoother, &mut zone, samples, blocks);
+        assert!(
+            values.windows(2).all(|w| w[0] <= w[1]),
+            "ramp going backwards with {} samples: {:?}",
+            samples,
+            values
+        );
+        assert_eq!(
+            values.last(),
+            Some(&1.0),
+            "with {} samples: {:?}",
+            samples,
+            values
+        );
+        if samples < 960 {
+            assert!(values[0] < 1.0, "no ramp with {} samples", samples);
+        }
+    }
+
+    #[test]
+    fn linear_ramp_reaches_target() {
+        for samples in [32, 64, 100, 128, 256, 512, 1024, 4096] {
+            reaches_target(SmoothingShape::Linear, samples);
+        }
+    }
+
+    #[test]
+    fn exponential_ramp_reaches_target() {
+        for samples in [32, 64, 100, 128, 256, 512, 1024, 4096] {
+            reaches_target(SmoothingShape::Exponential, samples);
+        }
+    }
+
+    #[test]
+    fn retargets_during_ramp() {
+        let mut zone = Box::new(0.0f32);
+        let smoothing = Smoothing {
+            time_ms: 20.0,
+            shape: SmoothingShape::Linear,
+        };
+        let mut smoother = ZoneSmoother::with_timed_zone(null_mut(), &mut *zone, smoothing, false);
+        *zone = 1.0;
+        let values = run_blocks(&mut smoother, &mut zone, 128, 3);
+        let reached = *values.last().unwrap();
+        assert!(reached > 0.0 && reached < 1.0);
+        *zone = -1.0;
+        let values = run_blocks(&mut smoother, &mut zone, 128, 40);
+        assert!(values.windows(2).all(|w| w[0] >= w[1]), "{:?}", values);
+        assert_eq!(values.last(), Some(&-1.0));
+    }
+
+    #[test]
+    fn stays_still_without_new_target() {
+        let mut zone = Box::new(0.5f32);
+        let smoothing = Smoothing {
+            time_ms: 20.0,
+            shape: SmoothingShape::Linear,
+        };
+        let mut smoother = ZoneSmoother::with_timed_zone(null_mut(), &mut *zone, smoothing, false);
+        let mut scheduled = false;
+        for _ in 0..10 {
+            scheduled |= smoother.plan_block(SAMPLE_RATE, 256, |_, _| {});
+        }
+        assert!(!scheduled);
+        assert_eq!(*zone, 0.5);
+    }
+}
@@ -0,0 +1,107 @@
+//! Which CPU the machine code of a factory is generated for
+//!
+//! LLVM can tune the code for the exact CPU it runs on (using e.g. AVX2 or
+//! AVX-512 when available), but such code will crash on an older CPU of the
+//! same architecture. So a factory built natively must never be read from a
+//! cache folder that was filled on another machine (or copied there), and the
+//! cache key of a native build thus contains the CPU name and the features it
+//! was detected to have.
+
+use super::wrapper::*;
+use std::ffi::{c_char, CStr, CString};
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+/// Which CPU the machine code of a factory is tuned for
+pub enum MachineTarget {
+    /// Tuned for the CPU of the current machine, with all its features
+    #[default]
+    Native,
+    /// A baseline CPU of the current architecture (e.g. plain x86-64), whose
+    /// code runs on any machine of that architecture. Slower, but a cache
+    /// filled with portable builds can be shipped to other machines
+    Portable,
+}
+
+impl MachineTarget {
+    /// The target string to give to libfaust. An empty string means the
+    /// current machine
+    pub(crate) fn llvm_target(&self) -> CString {
+        match self {
+            Self::Native => CString::default(),
+            Self::Portable => {
+                let native = native_llvm_target();
+                let triple = native.split(':').next().unwrap_or_default();
+                CString::new(format!("{}:{}", triple, baseline_cpu())).unwrap()
+            }
+        }
+    }
+
+    /// What identifies the generated code in the cache: the triple, the CPU
+    /// and (for native builds) the CPU features
+    pub(crate) fn cache_key(&self) -> String {
+        match self {
+            Self::Native => format!("{}+{}", native_llvm_target(), native_cpu_features()),
+            Self::Portable => self.llvm_target().to_string_lossy().into_owned(),
+        }
+    }
+}
+
+/// "triple:cpu" of the current machine, as seen by the LLVM inside libfaust.
+/// The engine must have been loaded
+pub(crate) fn native_llvm_target() -> String {
+    let mut buf = [0 as c_char; 256];
+    unsafe { w_getDSPMachineTarget(buf.as_mut_ptr(), buf.len() as i32) };
+    unsafe { CStr::from_ptr(buf.as_ptr()) }
+        .to_string_lossy()
+        .into_owned()
+}
+
+fn baseline_cpu() -> &'static str {
+    if cfg!(target_arch = "x86_64") {
+        "x86-64"
+    } else {
+        "generic"
+    }
+}
+
+/// The CPU name alone is not enough: virtual machines and some BIOS settings
+/// can disable features of a given CPU, so the ones that change the generated
+/// code the most are also detected
+fn native_cpu_features() -> String {
+    #[cfg(target_arch = "x86_64")]
+    {
+        let features = [
+            ("sse4.2", std::arch::is_x86_feature_detected!("sse4.2")),
+            ("avx", std::arch::is_x86_feature_detected!("avx")),
+            ("avx2", std::arch::is_x86_feature_detected!("avx2")),
+            ("fma", std::arch::is_x86_feature_detected!("fma")),
+            ("avx512f", std::arch::is_x86_feature_detected!("avx512f")),
+            ("avx512bw", std::arch::is_x86_feature_detected!("avx512bw")),
+            ("avx512vl", std::arch::is_x86_feature_detected!("avx512vl")),
+        ];
+        features
+            .iter()
+            .filter(|(_, detected)| *detected)
+            .map(|(name, _)| *name)
+            .collect::<Vec<_>>()
+            .join(",")
+    }
+    #[cfg(target_arch = "aarch64")]
+    {
+        let features = [
+            ("neon", std::arch::is_aarch64_feature_detected!("neon")),
+            ("fp16", std::arch::is_aarch64_feature_detected!("fp16")),
+            ("sve", std::arch::is_aarch64_feature_detected!("sve")),
+        ];
+        features
+            .iter()
+            .filter(|(_, detected)| *detected)
+            .map(|(name, _)| *name)
+            .collect::<Vec<_>>()
+            .join(",")
+    }
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    {
+        String::new()
+    }
+}
@@ -0,0 +1,261 @@
+//! Automatic bypass of DSPs that blow up or suddenly get way too expensive
+
+use std::{
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        Mutex,
+    },
+    time::Duration,
+};
+
+#[derive(Debug, Clone)]
+/// Settings of the watchdog of a [`crate::SingletonDsp`]
+pub struct WatchdogConfig {
+    /// A block is bad if its cost per sample is more than that many times the
+    /// usual one. None to only check the output samples (e.g. when rendering
+    /// offline, where time doesn't matter)
+    pub max_cost_ratio: Option<f32>,
+    /// A block is never judged too expensive if its load (compute time divided
+    /// by the duration of the block) is below that. An instrument with no
+    /// note playing is very cheap, so the first chord would otherwise look
+    /// like a runaway
+    pub min_load: f32,
+    /// How many good blocks are needed to learn the usual cost, before blocks
+    /// can be judged too expensive
+    pub learning_blocks: u32,
+    /// How many consecutive bad blocks before the DSP is bypassed
+    pub bad_blocks_before_bypass: u32,
+}
+
+impl Default for WatchdogConfig {
+    fn default() -> Self {
+        Self {
+            max_cost_ratio: Some(10.0),
+            min_load: 0.5,
+            learning_blocks: 100,
+            bad_blocks_before_bypass: 8,
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+/// Why the watchdog bypassed a DSP
+pub enum BypassReason {
+    /// It output NaN or infinite samples
+    NonFinite,
+    /// Its blocks cost that many times more than usual
+    TooSlow { cost_ratio: f32 },
+}
+
+impl std::fmt::Display for BypassReason {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            Self::NonFinite => write!(f, "the DSP output NaN or infinite values"),
+            Self::TooSlow { cost_ratio } => {
+                write!(f, "the DSP got {:.0} times slower than usual", cost_ratio)
+            }
+        }
+    }
+}
+
+#[derive(Debug)]
+struct WatchdogState {
+    config: Option<WatchdogConfig>,
+    /// Moving average of the cost per sample of good blocks, in seconds
+    usual_cost: f64,
+    good_blocks: u32,
+    bad_blocks: u32,
+}
+
+#[derive(Debug)]
+/// Checks each computed block. After too many bad blocks in a row, the output
+/// is faded out and the DSP is no longer computed until it's reset, so a
+/// single misbehaving DSP cannot eat the realtime budget of a whole session
+pub(crate) struct Watchdog {
+    /// Only ever locked by the audio thread, except when changing the config
+    /// or resetting
+    state: Mutex<WatchdogState>,
+    /// Why the DSP is bypassed, as encoded by [`encode_reason`]. 0 if it
+    /// isn't. Kept out of the state so the editor can poll it at each frame
+    /// without ever making the audio thread wait
+    reason: AtomicU64,
+    /// Whether there is a config, so blocks are not even try_locked when the
+    /// watchdog is off
+    enabled: AtomicBool,
+}
+
+/// Weight of the last good block in the moving average of the cost
+const COST_SMOOTHING: f64 = 0.01;
+
+const NON_FINITE: u64 = 1 << 32;
+const TOO_SLOW: u64 = 2 << 32;
+
+/// Packs the kind of the reason in the high bits, and the cost ratio in the
+/// low ones
+fn encode_reason(reason: Option<BypassReason>) -> u64 {
+    match reason {
+        None => 0,
+        Some(BypassReason::NonFinite) => NON_FINITE,
+        Some(BypassReason::TooSlow { cost_ratio }) => TOO_SLOW | cost_ratio.to_bits() as u64,
+    }
+}
+
+fn decode_reason(bits: u64) -> Option<BypassReason> {
+    match bits & !0xFFFF_FFFF {
+        NON_FINITE => Some(BypassReason::NonFinite),
+        TOO_SLOW => Some(BypassReason::TooSlow {
+            cost_ratio: f32::from_bits(bits as u32),
+        }),
+        _ => None,
+    }
+}
+
+impl Watchdog {
+    pub(crate) fn new() -> Self {
+        Self {
+            state: Mutex::new(WatchdogState {
+                config: None,
+                usual_cost: 0.0,
+                good_blocks: 0,
+                bad_blocks: 0,
+            }),
+            reason: AtomicU64::new(0),
+            enabled: AtomicBool::new(false),
+        }
+    }
+
+    pub(crate) fn set_config(&self, config: Option<WatchdogConfig>) {
+        let mut state = self.state.lock().unwrap();
+        self.enabled.store(config.is_some(), Ordering::Relaxed);
+        state.config = config;
+        Self::reset_state(&mut state);
+        self.reason.store(0, Ordering::Relaxed);
+    }
+
+    /// Stops bypassing the DSP, and learns its usual cost again
+    pub(crate) fn reset(&self) {
+        Self::reset_state(&mut self.state.lock().unwrap());
+        self.reason.store(0, Ordering::Relaxed);
+    }
+
+    fn reset_state(state: &mut WatchdogState) {
+        state.usual_cost = 0.0;
+        state.good_blocks = 0;
+        state.bad_blocks = 0;
+    }
+
+    pub(crate) fn is_bypassed(&self) -> bool {
+        self.reason.load(Ordering::Relaxed) != 0
+    }
+
+    pub(crate) fn bypass_reason(&self) -> Option<BypassReason> {
+        decode_reason(self.reason.load(Ordering::Relaxed))
+    }
+
+    /// To be called after each block has been computed, with the output
+    /// channels. Non-finite samples are replaced by zeros, and the block is
+    /// faded out if it's the one that triggers the bypass. The block isn't
+    /// checked if the config is being changed
+    pub(crate) fn after_block(
+        &self,
+        compute_time: Duration,
+        block_duration: Duration,
+        outputs: &mut [&mut [f32]],
+    ) {
+        if !self.enabled.load(Ordering::Relaxed) {
+            return;
+        }
+        let Ok(mut guard) = self.state.try_lock() else {
+            return;
+        };
+        let state = &mut *guard;
+        let Some(config) = &state.config else {
+            return;
+        };
+        let samples = outputs.first().map_or(0, |o| o.len());
+        if samples == 0 {
+            return;
+        }
+        let non_finite = outputs.iter().any(|o| o.iter().any(|s| !s.is_finite()));
+        if non_finite {
+            for s in outputs.iter_mut().flat_map(|o| o.iter_mut()) {
+                if !s.is_finite() {
+                    *s = 0.0;
+                }
+            }
+        }
+        let cost = compute_time.as_secs_f64() / samples as f64;
+        let cost_ratio = (cost / state.usual_cost) as f32;
+        let too_slow = match config.max_cost_ratio {
+            Some(max) => {
+                state.good_blocks >= config.learning_blocks
+                    && cost_ratio > max
+                    && compute_time.as_secs_f32() / block_duration.as_secs_f32() > config.min_load
+            }
+            None => false,
+        };
+
+        if !non_finite && !too_slow {
+            state.bad_blocks = 0;
+            state.usual_cost = if state.good_blocks == 0 {
+                cost
+            } else {
+                state.usual_cost + (cost - state.usual_cost) * COST_SMOOTHING
+            };
+            state.good_blocks = state.good_blocks.saturating_add(1);
+            return;
+        }
+        state.bad_blocks += 1;
+        if state.bad_blocks >= config.bad_blocks_before_bypass {
+            let reason = if non_finite {
+                BypassReason::NonFinite
+            } else {
+                BypassReason::TooSlow { cost_ratio }
+            };
+            for out in outputs.iter_mut() {
+                let len = out.len() as f32;
+                for (i, s) in out.iter_mut().enumerate() {
+                    *s *= 1.0 - i as f32 / len;
+                }
+            }
+            self.reason
+                .store(encode_reason(Some(reason)), Ordering::Relaxed);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn reasons_survive_encoding() {
+        for reason in [
+            None,
+            Some(BypassReason::NonFinite),
+            Some(BypassReason::TooSlow { cost_ratio: 12.5 }),
+            Some(BypassReason::TooSlow { cost_ratio: 0.0 }),
+        ] {
+            assert_eq!(decode_reason(encode_reason(reason)), reason);
+        }
+    }
+
+    #[test]
+    fn bypass_is_reported_without_locking() {
+        let watchdog = Watchdog::new();
+        watchdog.set_config(Some(WatchdogConfig::default()));
+        let mut out = vec![0.0; 64];
+        for _ in 0..WatchdogConfig::default().bad_blocks_before_bypass {
+            // Non-finite samples are replaced at each block
+            out.fill(f32::NAN);
+            watchdog.after_block(
+                Duration::ZERO,
+                Duration::from_millis(1),
+                &mut [&mut out[..]],
+            );
+        }
+        let _state = watchdog.state.lock().unwrap();
+        assert!(watchdog.is_bypassed());
+        assert_eq!(watchdog.bypass_reason(), Some(BypassReason::NonFinite));
+    }
+}
@@ -1,3 +1,4 @@
+use super::smoothing::Smoothing;
 use super::wrapper::*;
 use std::{
     collections::{HashMap, VecDeque},
@@ -102,6 +103,8 @@ pub struct NumMetadata {
     pub hidden: bool,
     /// A text to show when hovering the widget
     pub tooltip: Option<String>,
+    /// Whether changes of value should be smoothed by faust_jit
+    pub smooth: Option<Smoothing>,
 }
 
 #[derive(Debug)]
@@ -140,6 +143,7 @@ pub enum DspWidget<Z> {
         zone: Z,
         hidden: bool,
         tooltip: Option<String>,
+        smooth: Option<Smoothing>,
     },
     /// Widgets corresponding to interactive numerical floating-point parameters
     /// (hslider, vslider and nentry in Faust), which can take continuous or
@@ -244,6 +248,7 @@ enum MetadataElem {
     Hidden(bool),
     Unit(String),
     Tooltip(String),
+    Smooth(Smoothing),
 }
 
 pub(crate) struct DspWidgetsBuilder {
@@ -302,6 +307,7 @@ impl DspWidgetsBuilder {
                 scale: WidgetScale::Lin,
                 hidden: false,
                 tooltip: None,
+                smooth: None,
             };
             while let Some(elem) = md_elems.pop() {
                 match elem {
@@ -310,6 +316,7 @@ impl DspWidgetsBuilder {
                     ME::Hidden(h) => metadata.hidden = h,
                     ME::Unit(u) => metadata.unit = Some(u),
                     ME::Tooltip(t) => metadata.tooltip = Some(t),
+                    ME::Smooth(s) => metadata.smooth = Some(s),
                 }
             }
 
@@ -326,6 +333,7 @@ impl DspWidgetsBuilder {
                     zone: unsafe { Zone::from_zone_ptr(decl.zone) },
                     hidden: metadata.hidden,
                     tooltip: metadata.tooltip,
+                    smooth: metadata.smooth,
                 },
                 W::HORIZONTAL_SLIDER | W::VERTICAL_SLIDER | W::NUM_ENTRY => DspWidget::NumParam {
                     layout: NumParamLayout::from_decl_type(decl.typ),
@@ -363,10 +371,9 @@ impl DspWidgetsBuilder {
     }
 }
 
-// The C++ wrapper-lib will link with these functions:
+// The C++ wrapper-lib will be given these functions as callbacks:
 
-#[no_mangle]
-extern "C" fn rs_declare_widget(
+pub(crate) extern "C" fn rs_declare_widget(
     builder_ptr: *mut c_void,
     label_ptr: *const c_char,
     decl: WWidgetDecl,
@@ -387,8 +394,7 @@ extern "C" fn rs_declare_widget(
     builder.widget_decls.push_back((label, decl));
 }
 
-#[no_mangle]
-extern "C" fn rs_declare_metadata(
+pub(crate) extern "C" fn rs_declare_metadata(
     builder_ptr: *mut c_void,
     zone_ptr: *mut f32,
     key_ptr: *const c_char,
@@ -435,6 +441,7 @@ extern "C" fn rs_declare_metadata(
             "exp" => Some(ME::Scale(WidgetScale::Exp)),
             _ => None,
         },
+        "smooth" => Smoothing::parse(value).map(ME::Smooth),
         "hidden" => match value {
             "0" => Some(ME::Hidden(false)),
             "1" => Some(ME::Hidden(true)),
@@ -451,6 +458,132 @@ extern "C" fn rs_declare_metadata(
     }
 }
 
+/// Lists the zones of the parameters that declare a `[smooth:xxx]` metadata
+pub(crate) fn smoothed_zones(
+    widgets: &mut [DspWidget<&mut f32>],
+    out: &mut Vec<(*mut f32, Smoothing)>,
+) {
+    for w in widgets {
+        match w {
+            DspWidget::Box { inner, .. } => smoothed_zones(inner, out),
+            DspWidget::BoolParam {
+                zone,
+                smooth: Some(smoothing),
+                ..
+            }
+            | DspWidget::NumParam {
+                zone,
+                metadata:
+                    NumMetadata {
+                        smooth: Some(smoothing),
+                        ..
+                    },
+                ..
+            } => out.push((&mut **zone as *mut f32, *smoothing)),
+            _ => {}
+        }
+    }
+}
+
+#[derive(Debug, Clone)]
+/// An interactive parameter, as found by its OSC-style path
+pub(crate) struct ParamPath {
+    /// Labels of the boxes containing the parameter and of the parameter
+    /// itself, e.g. `/synth/filter/cutoff`
+    pub(crate) path: String,
+    pub(crate) zone: *mut f32,
+    pub(crate) min: f32,
+    pub(crate) max: f32,
+}
+
+// The zone pointer is only dereferenced while the SingletonDsp it belongs to
+// is alive
+unsafe impl Send for ParamPath {}
+unsafe impl Sync for ParamPath {}
+
+/// Lists the interactive parameters with their paths. Like in Faust's OSC
+/// address space, characters that are not allowed in OSC addresses are
+/// replaced by `_`
+pub(crate) fn param_paths(
+    widgets: &mut [DspWidget<&mut f32>],
+    prefix: &str,
+    out: &mut Vec<ParamPath>,
+) {
+    for w in widgets {
+        let path = format!("{}/{}", prefix, osc_label(w.label()));
+        match w {
+            DspWidget::Box { inner, .. } => param_paths(inner, &path, out),
+            DspWidget::BoolParam { zone, .. } => out.push(ParamPath {
+                path,
+                zone: &mut **zone as *mut f32,
+                min: 0.0,
+                max: 1.0,
+            }),
+            DspWidget::NumParam { zone, min, max, .. } => out.push(ParamPath {
+                path,
+                zone: &mut **zone as *mut f32,
+                min: *min,
+                max: *max,
+            }),
+            DspWidget::NumDisplay { .. } => {}
+        }
+    }
+}
+
+fn osc_label(label: &str) -> String {
+    label
+        .chars()
+        .map(|c| match c {
+            ' ' | '#' | '*' | ',' | '/' | '?' | '[' | ']' | '{' | '}' | '(' | ')' => '_',
+            c => c,
+        })
+        .collect()
+}
+
+/// Copies the values of the parameters of `from` to the ones of `to` that have
+/// the same path of labels. The selected options of menus and radio buttons,
+/// which are GUI state, are updated too so the GUI does not overwrite the
+/// copied values
+pub(crate) fn copy_values(from: &[DspWidget<&mut f32>], to: &mut [DspWidget<&mut f32>]) {
+    for w in to {
+        let Some(src) = from.iter().find(|src| src.label() == w.label()) else {
+            continue;
+        };
+        match (src, w) {
+            (
+                DspWidget::Box {
+                    layout: src_layout,
+                    inner: src_inner,
+                    ..
+                },
+                DspWidget::Box { layout, inner, .. },
+            ) => {
+                if let (BoxLayout::Tab { selected: src_sel }, BoxLayout::Tab { selected }) =
+                    (src_layout, layout)
+                {
+                    *selected = *src_sel;
+                }
+                copy_values(src_inner, inner);
+            }
+            (DspWidget::BoolParam { zone: src_zone, .. }, DspWidget::BoolParam { zone, .. }) => {
+                **zone = **src_zone
+            }
+            (
+                DspWidget::NumParam { zone: src_zone, .. },
+                DspWidget::NumParam { zone, style, .. },
+            ) => {
+                **zone = **src_zone;
+                if let NumParamStyle::Menu(vals) | NumParamStyle::Radio(vals) = style {
+                    if let Some(i) = vals.options.iter().position(|(_, v)| *v == **zone) {
+                        vals.selected = i;
+                    }
+                }
+            }
+            _ => {}
+        }
+    }
+}
+
 fn parse_metadata_dict(s: &str) -> Option<Vec<(String, f32)>> {
     let trimmed = s.trim();
     let without_brackets = &trimmed[1..trimmed.len() - 1].trim();
@@ -3,5 +3,139 @@
 #![allow(non_camel_case_types)]
 #![allow(non_upper_case_globals)]
 #![allow(dead_code)]
+#![allow(non_snake_case)]
 
 include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
+
+#[cfg(feature = "lazy_engine")]
+pub use lazy::*;
+
+/// Makes sure the wrapper functions can be called. The wrapper is statically
+/// linked in, so there is nothing to do
+#[cfg(not(feature = "lazy_engine"))]
+pub fn load_engine() -> Result<(), String> {
+    Ok(())
+}
+
+/// With the `lazy_engine` feature, the wrapper and libfaust live in a separate
+/// shared object (see build.rs), which is loaded the first time a DSP has to be
+/// created. Until then, neither libfaust nor llvm are mapped in the process.
+///
+/// The free functions below have the exact same signatures as the ones bindgen
+/// generates in the statically linked case, so the rest of the crate does not
+/// need to know which mode is used.
+#[cfg(feature = "lazy_engine")]
+mod lazy {
+    use super::*;
+    use std::ffi::{CStr, OsStr};
+    use std::os::raw::{c_char, c_int, c_uchar, c_void};
+    use std::os::unix::ffi::OsStrExt;
+    use std::path::PathBuf;
+    use std::sync::OnceLock;
+
+    static ENGINE: OnceLock<Result<FaustJitEngine, String>> = OnceLock::new();
+
+    /// Loads the engine if it hasn't been loaded yet. It is looked for, in
+    /// order:
+    ///
+    /// - at the path given by the FAUST_JIT_ENGINE env var, if set,
+    /// - next to the binary (plugin or executable) faust_jit is linked in, so
+    ///   it can be shipped in the same folder,
+    /// - where it was built, for development.
+    pub fn load_engine() -> Result<(), String> {
+        ENGINE
+            .get_or_init(|| {
+                let candidates: Vec<PathBuf> = match std::env::var_os("FAUST_JIT_ENGINE") {
+                    Some(path) => vec![path.into()],
+                    None => binary_folder()
+                        .map(|dir| dir.join(env!("FAUST_JIT_ENGINE_NAME")))
+                        .into_iter()
+                        .chain([PathBuf::from(env!("FAUST_JIT_ENGINE_PATH"))])
+                        .collect(),
+                };
+                let mut errors = vec![];
+                for path in candidates {
+                    if !path.exists() {
+                        errors.push(format!("{:?} does not exist", path));
+                        continue;
+                    }
+                    match unsafe { FaustJitEngine::new(&path) } {
+                        Ok(engine) => return Ok(engine),
+                        Err(e) => errors.push(format!("{:?}: {}", path, e)),
+                    }
+                }
+                Err(format!(
+                    "Could not load the faust engine ({})",
+                    errors.join(", ")
+                ))
+            })
+            .as_ref()
+            .map(|_| ())
+            .map_err(String::clone)
+    }
+
+    /// The folder of the shared object or executable this code is part of
+    fn binary_folder() -> Option<PathBuf> {
+        let mut info: libc::Dl_info = unsafe { std::mem::zeroed() };
+        let found = unsafe {
+            libc::dladdr(
+                binary_folder as fn() -> Option<PathBuf> as *const c_void,
+                &mut info,
+            )
+        };
+        if found == 0 || info.dli_fname.is_null() {
+            return None;
+        }
+        let path = unsafe { CStr::from_ptr(info.dli_fname) };
+        let path = PathBuf::from(OsStr::from_bytes(path.to_bytes()));
+        // dli_fname can be relative for the main executable
+        std::fs::canonicalize(path)
+            .ok()?
+            .parent()
+            .map(PathBuf::from)
+    }
+
+    fn engine() -> &'static FaustJitEngine {
+        match ENGINE.get() {
+            Some(Ok(engine)) => engine,
+            _ => panic!("The faust engine is used before having been loaded"),
+        }
+    }
+
+    macro_rules! forward_to_engine {
+        ($(fn $name:ident($($arg:ident: $typ:ty),*) $(-> $ret:ty)?;)*) => {
+            $(
+                pub unsafe fn $name($($arg: $typ),*) $(-> $ret)? {
+                    engine().$name($($arg),*)
+                }
+            )*
+        };
+    }
+
+    forward_to_engine! {
+        fn w_createDSPFactoryFromFile(filepath: *const c_char, argc: c_int, argv: *mut *const c_char, target: *const c_char, opt_level: c_int, err_msg_c: *mut c_char) -> *mut WFactory;
+        fn w_writeFactoryToFolder(factory: *mut WFactory, folder: *const c_char, target: *const c_char);
+        fn w_readFactoryFromFolder(folder: *const c_char, target: *const c_char, err_msg_c: *mut c_char) -> *mut WFactory;
+        fn w_getDSPMachineTarget(target_c: *mut c_char, size: c_int);
+        fn w_deleteDSPFactory(factory: *mut WFactory);
+        fn w_shareDSPCode(a: *mut WFactory, b: *mut WFactory) -> bool;
+        fn w_setDSPMemory(factory: *mut WFactory);
+        fn w_checkDSPFile(filepath: *const c_char, argc: c_int, argv: *mut *const c_char, err_msg_c: *mut c_char) -> bool;
+        fn w_createDSPInstance(factory: *mut WFactory, sample_rate: c_int, nvoices: c_int, group_voices: bool, memory: WDspMemory) -> *mut WDsp;
+        fn w_getDSPInfo(dsp: *mut WDsp) -> DspInfo;
+        fn w_computeDSP(dsp: *mut WDsp, count: c_int, buf: *mut *mut f32);
+        fn w_computeDSPDirect(dsp: *mut WDsp, count: c_int, buf: *mut *mut f32);
+        fn w_skipDSPBlock(dsp: *mut WDsp);
+        fn w_warmUpFactory(factory: *mut WFactory, sample_rate: c_int, nvoices: c_int, block_size: c_int, blocks: c_int) -> WCostEstimate;
+        fn w_clearDSP(dsp: *mut WDsp);
+        fn w_deleteDSPInstance(dsp: *mut WDsp);
+        fn w_createUIs(dsp: *mut WDsp, gui_builder: *mut c_void, declare_widget: WDeclareWidgetFn, declare_metadata: WDeclareMetadataFn) -> *mut WUIs;
+        fn w_deleteUIs(h: *mut WUIs);
+        fn w_updateGuis(h: *mut WUIs);
+        fn w_handleRawMidi(h: *mut WUIs, time: f64, bytes: *const c_uchar);
+        fn w_handleMidiSync(h: *mut WUIs, time: f64, status: WMidiSyncMsg);
+        fn w_addTimedZone(dsp: *mut WDsp, zone: *mut f32) -> bool;
+        fn w_removeTimedZone(dsp: *mut WDsp, zone: *mut f32);
+        fn w_setTimedZoneValue(dsp: *mut WDsp, zone: *mut f32, time: f64, value: f32);
+    }
+}
@@ -96,6 +96,7 @@ fn faust_widgets_ui_rec(ui: &mut egui::Ui, widgets: &mut [DspWidget<&mut f32>],
                 zone,
                 hidden: false,
                 tooltip,
+                ..
             } => {
                 let resp = match layout {
                     BoolParamLayout::Held => {
@@ -141,6 +142,7 @@ fn faust_widgets_ui_rec(ui: &mut egui::Ui, widgets: &mut [DspWidget<&mut f32>],
                         scale,
                         hidden: false,
                         tooltip,
+                        ..
                     },
             } => {
                 let rng = std::ops::RangeInclusive::new(*min, *max);
@@ -214,6 +216,7 @@ fn faust_widgets_ui_rec(ui: &mut egui::Ui, widgets: &mut [DspWidget<&mut f32>],
                         scale: _,
                         hidden: false,
                         tooltip,
+                        ..
                     },
             } => {
                 let cur_val = **zone;
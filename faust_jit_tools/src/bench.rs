@@ -0,0 +1,89 @@
+//! Measures how much time a DSP script takes to compute
+//!
+//! Usage: faust_jit_bench SCRIPT [-I DIR]... [--cache DIR] [--sr RATE]
+//!            [--voices N] [--notes N] [--block N] [--seconds S]
+//!            [--portable] [--quick] [--perf] [--perf-raw CODE]...
+//!
+//! With `--portable`, the script is also compiled for a baseline CPU of the
+//! current architecture, to see what tuning the code for the current CPU
+//! brings.
+//!
+//! With `--quick`, the script is also compiled at a lower LLVM optimization
+//! level, and the compile times and the slowdown are reported. The scripts are
+//! then compiled even if cached, for the compile times to be meaningful.
+//!
+//! With `--perf` (Linux only), hardware counters are read around the calls to
+//! the DSP, and reported per sample for each variant: cycles, instructions
+//! (and IPC), L1d and last-level cache misses, branch misses. A low IPC with
+//! many cache misses points at memory (e.g. huge delay lines), many branch
+//! misses at data-dependent code. `--perf-raw` adds CPU-specific events, as
+//! given to `perf stat -e rCODE`, e.g. `--perf-raw 1eca` to count the
+//! floating-point assists (denormals) on recent Intel CPUs.
+
+use faust_jit::{CompileOptions, MachineTarget, OptLevel};
+use faust_jit_tools::*;
+use std::{path::PathBuf, time::Instant};
+
+fn main() {
+    let mut args = Args::from_env();
+    let load_settings = LoadSettings::from_args(&mut args);
+    let bench_settings = BenchSettings::from_args(&mut args);
+    let portable = args.flag("--portable");
+    let quick = args.flag("--quick");
+    let scripts = args.positional();
+    let [script] = scripts.as_slice() else {
+        fail("Expected exactly one DSP script");
+    };
+    let script = PathBuf::from(script);
+
+    let load_settings = LoadSettings {
+        cache: if quick { None } else { load_settings.cache },
+        ..load_settings
+    };
+    let native_options = CompileOptions::default();
+    let start = Instant::now();
+    let native = load_settings
+        .load(&script, &native_options)
+        .unwrap_or_else(|e| fail(&e));
+    let native_compile_time = start.elapsed();
+    let native_res = run_bench(&native, &bench_settings);
+    native_res.report("native", &bench_settings);
+
+    if portable {
+        let options = CompileOptions {
+            target: MachineTarget::Portable,
+            ..CompileOptions::default()
+        };
+        let dsp = load_settings
+            .load(&script, &options)
+            .unwrap_or_else(|e| fail(&e));
+        assert!(!dsp.shares_code_with(&native), "Got the native build back");
+        let res = run_bench(&dsp, &bench_settings);
+        res.report("portable", &bench_settings);
+        println!(
+            "native speedup: {:.2}x",
+            res.total.as_secs_f64() / native_res.total.as_secs_f64()
+        );
+    }
+
+    if quick {
+        let options = CompileOptions {
+            opt_level: OptLevel::Quick,
+            ..CompileOptions::default()
+        };
+        let start = Instant::now();
+        let dsp = load_settings
+            .load(&script, &options)
+            .unwrap_or_else(|e| fail(&e));
+        let compile_time = start.elapsed();
+        assert!(!dsp.shares_code_with(&native), "Got the full build back");
+        let res = run_bench(&dsp, &bench_settings);
+        res.report("quick", &bench_settings);
+        println!(
+            "compiled in {:.2} s instead of {:.2} s, {:.2}x slower",
+            compile_time.as_secs_f64(),
+            native_compile_time.as_secs_f64(),
+            res.total.as_secs_f64() / native_res.total.as_secs_f64()
+        );
+    }
+}
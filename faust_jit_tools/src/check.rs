@@ -0,0 +1,32 @@
+//! Reports the errors of DSP scripts without compiling them, as
+//! `file:line: message` lines, which editors and file watchers can parse
+//!
+//! Usage: faust_jit_check SCRIPT... [-I DIR]...
+//!
+//! Exits with status 1 if any script has errors.
+
+use faust_jit::check_script;
+use faust_jit_tools::*;
+use std::path::Path;
+
+fn main() {
+    let mut args = Args::from_env();
+    let import_paths = import_paths_from_args(&mut args);
+    let import_paths: Vec<&Path> = import_paths.iter().map(|p| p.as_path()).collect();
+    let scripts = args.positional();
+    if scripts.is_empty() {
+        fail("Expected at least one DSP script");
+    }
+    let mut failed = false;
+    for script in &scripts {
+        if let Err(errors) = check_script(Path::new(script), &import_paths) {
+            failed = true;
+            for e in errors {
+                println!("{}", e);
+            }
+        }
+    }
+    if failed {
+        std::process::exit(1);
+    }
+}
@@ -0,0 +1,302 @@
+//! Measures how instances of a same DSP slow each other down when they are
+//! computed in parallel, like tracks in a DAW
+//!
+//! Usage: faust_jit_contention SCRIPT [-I DIR]... [--cache DIR] [--sr RATE]
+//!            [--voices N] [--notes N] [--block N] [--seconds S]
+//!            [--instances 1,4,16] [--threads 1,2,4] [--reload-every MS]
+//!
+//! For each combination of instance and thread counts, the instances (all
+//! sharing the same factory) are dealt to the threads, which compute one block
+//! each and then wait on a barrier for the others, as the worker pool of a
+//! host does. The time between two barriers is the time the host would need
+//! to compute the block. Its percentiles are reported, along with the
+//! efficiency against a perfect scaling of the cost of one instance on one
+//! thread, and the last-level cache misses per block (on Linux, if the kernel
+//! allows perf counters).
+//!
+//! With `--reload-every`, another thread keeps compiling and dropping the
+//! script during the runs, to see what reloads in a plugin do to the other
+//! instances. Each reload compiles a slightly modified copy of the script, so
+//! that it is really compiled instead of reusing the live factory.
+
+use faust_jit::{CompileOptions, Factory, SingletonDsp};
+use faust_jit_tools::{
+    perf::{Counter, CounterKind},
+    *,
+};
+use std::{
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering},
+        Arc, Barrier,
+    },
+    time::{Duration, Instant},
+};
+
+fn parse_list(args: &mut Args, name: &str, default: &[usize]) -> Vec<usize> {
+    match args.values(name).pop() {
+        Some(list) => list
+            .split(',')
+            .map(|n| match n.trim().parse() {
+                Ok(n) if n > 0 => n,
+                _ => fail(&format!("Invalid value for {}: {}", name, list)),
+            })
+            .collect(),
+        None => default.to_vec(),
+    }
+}
+
+/// Block times of one run
+struct RunResult {
+    /// Sorted
+    block_times: Vec<Duration>,
+    /// None if counters could not be opened
+    cache_misses_per_block: Option<f64>,
+}
+
+impl RunResult {
+    fn percentile(&self, p: f64) -> Duration {
+        let i = ((self.block_times.len() - 1) as f64 * p).round() as usize;
+        self.block_times[i]
+    }
+
+    fn mean(&self) -> Duration {
+        self.block_times.iter().sum::<Duration>() / self.block_times.len() as u32
+    }
+}
+
+fn run(
+    factory: &Arc<Factory>,
+    load_settings: &LoadSettings,
+    bench_settings: &BenchSettings,
+    num_instances: usize,
+    num_threads: usize,
+) -> RunResult {
+    let dsps: Vec<SingletonDsp> = (0..num_instances)
+        .map(|_| {
+            let dsp = SingletonDsp::from_factory(
+                factory,
+                load_settings.sample_rate,
+                &load_settings.load_mode,
+                load_settings.memory,
+            );
+            hold_notes(&dsp, bench_settings.held_notes);
+            dsp
+        })
+        .collect();
+    let block_size = bench_settings.block_size;
+    let blocks = ((bench_settings.seconds * load_settings.sample_rate as f64 / block_size as f64)
+        as usize)
+        .max(1);
+    let barrier = Barrier::new(num_threads);
+    let cache_misses = AtomicU64::new(0);
+    let counters_opened = AtomicUsize::new(0);
+
+    let block_times = std::thread::scope(|s| {
+        let workers: Vec<_> = (0..num_threads)
+            .map(|t| {
+                let my_dsps: Vec<&SingletonDsp> =
+                    dsps.iter().skip(t).step_by(num_threads).collect();
+                let (barrier, cache_misses, counters_opened) =
+                    (&barrier, &cache_misses, &counters_opened);
+                s.spawn(move || {
+                    // Input noise is generated once, and copied at each block
+                    // like a host copies the output of the previous node
+                    let mut noise = NoiseGen::new();
+                    let mut inputs = vec![];
+                    let mut bufs = vec![];
+                    for dsp in &my_dsps {
+                        let num_chans = dsp.info.num_inputs.max(dsp.info.num_outputs) as usize;
+                        let mut input = vec![vec![0.0f32; block_size]; num_chans];
+                        noise.fill(&mut input);
+                        bufs.push(input.clone());
+                        inputs.push(input);
+                    }
+                    let counter = Counter::open(CounterKind::CacheMisses);
+                    let mut times = Vec::with_capacity(if t == 0 { blocks } else { 0 });
+                    barrier.wait();
+                    let start_misses = counter.as_ref().map_or(0, |c| c.read());
+                    for _ in 0..blocks {
+                        let start = Instant::now();
+                        for ((dsp, bufs), input) in my_dsps.iter().zip(&mut bufs).zip(&inputs) {
+                            for (buf, input) in bufs.iter_mut().zip(input) {
+                                buf.copy_from_slice(input);
+                            }
+                            let mut slices: Vec<&mut [f32]> =
+                                bufs.iter_mut().map(|b| b.as_mut_slice()).collect();
+                            dsp.process_buffers(&mut slices);
+                        }
+                        barrier.wait();
+                        if t == 0 {
+                            times.push(start.elapsed());
+                        }
+                    }
+                    if let Some(c) = &counter {
+                        cache_misses.fetch_add(c.read() - start_misses, Ordering::Relaxed);
+                        counters_opened.fetch_add(1, Ordering::Relaxed);
+                    }
+                    times
+                })
+            })
+            .collect();
+        let mut times = vec![];
+        for w in workers {
+            times.extend(w.join().unwrap());
+        }
+        times
+    });
+
+    let mut block_times = block_times;
+    block_times.sort();
+    RunResult {
+        block_times,
+        cache_misses_per_block: (counters_opened.load(Ordering::Relaxed) == num_threads)
+            .then(|| cache_misses.load(Ordering::Relaxed) as f64 / blocks as f64),
+    }
+}
+
+/// Loads and drops the script until stopped. Returns how many reloads were
+/// done
+///
+/// Loading the script as is would give back the factory the runs use, as
+/// libfaust reuses live factories with the same code, so nothing would be
+/// compiled. Each reload instead loads a copy of the script with a
+/// `declare` holding the reload count, which gives a new factory key and thus
+/// a full compilation, as an edited script does in a plugin. The copy is
+/// written to the temporary folder (the folder of the script is added to the
+/// import paths), and the cache is not used, not to fill it with these copies
+fn reload_loop(
+    load_settings: &LoadSettings,
+    script: &Path,
+    options: &CompileOptions,
+    every: Duration,
+    stop: &AtomicBool,
+) -> usize {
+    let code = std::fs::read_to_string(script)
+        .unwrap_or_else(|e| fail(&format!("Cannot read {}: {}", script.display(), e)));
+    let copy =
+        std::env::temp_dir().join(format!("faust_jit_contention_{}.dsp", std::process::id()));
+    let mut import_paths: Vec<&Path> = load_settings
+        .import_paths
+        .iter()
+        .map(|p| p.as_path())
+        .collect();
+    if let Some(folder) = script.parent().filter(|f| !f.as_os_str().is_empty()) {
+        import_paths.push(folder);
+    }
+    let mut reloads = 0;
+    while !stop.load(Ordering::Relaxed) {
+        let salted = format!("{}\ndeclare contention_reload \"{}\";\n", code, reloads);
+        std::fs::write(&copy, salted)
+            .unwrap_or_else(|e| fail(&format!("Cannot write {}: {}", copy.display(), e)));
+        match SingletonDsp::from_file(
+            None,
+            &copy,
+            &import_paths,
+            options,
+            load_settings.sample_rate,
+            &load_settings.load_mode,
+            load_settings.memory,
+        ) {
+            Ok(dsp) => drop(dsp),
+            Err(e) => fail(&e),
+        }
+        reloads += 1;
+        std::thread::sleep(every);
+    }
+    let _ = std::fs::remove_file(&copy);
+    reloads
+}
+
+fn main() {
+    let mut args = Args::from_env();
+    let load_settings = LoadSettings::from_args(&mut args);
+    let bench_settings = BenchSettings::from_args(&mut args);
+    let instance_counts = parse_list(&mut args, "--instances", &[1, 4, 16]);
+    let thread_counts = parse_list(&mut args, "--threads", &[1, 2, 4]);
+    let reload_every = args
+        .value::<u64>("--reload-every")
+        .map(Duration::from_millis);
+    let scripts = args.positional();
+    let [script] = scripts.as_slice() else {
+        fail("Expected exactly one DSP script");
+    };
+    let script = PathBuf::from(script);
+    let options = CompileOptions::default();
+    let import_paths: Vec<&Path> = load_settings
+        .import_paths
+        .iter()
+        .map(|p| p.as_path())
+        .collect();
+    let factory = Arc::new(
+        Factory::from_file(
+            load_settings.cache.as_ref(),
+            &script,
+            &import_paths,
+            &options,
+        )
+        .unwrap_or_else(|e| fail(&e)),
+    );
+
+    let block_duration = Duration::from_secs_f64(
+        bench_settings.block_size as f64 / load_settings.sample_rate as f64,
+    );
+    println!(
+        "block of {} samples: {:.1} us",
+        bench_settings.block_size,
+        block_duration.as_secs_f64() * 1e6
+    );
+    // The baseline is always measured without reloads
+    let baseline = run(&factory, &load_settings, &bench_settings, 1, 1).mean();
+
+    let stop = AtomicBool::new(false);
+    std::thread::scope(|s| {
+        let (load_settings, script, options, stop) = (&load_settings, &script, &options, &stop);
+        let reloader = reload_every
+            .map(|every| s.spawn(move || reload_loop(load_settings, script, options, every, stop)));
+        for &num_threads in &thread_counts {
+            for &num_instances in &instance_counts {
+                let res = run(
+                    &factory,
+                    &load_settings,
+                    &bench_settings,
+                    num_instances,
+                    num_threads,
+                );
+                let ideal = baseline * num_instances.div_ceil(num_threads) as u32;
+                let us = |d: Duration| d.as_secs_f64() * 1e6;
+                print!(
+                    "{} instances, {} threads: p50 {:.1} us, p99 {:.1} us, p99.9 {:.1} us, \
+                     max {:.1} us, efficiency {:.0}%",
+                    num_instances,
+                    num_threads,
+                    us(res.percentile(0.5)),
+                    us(res.percentile(0.99)),
+                    us(res.percentile(0.999)),
+                    us(*res.block_times.last().unwrap()),
+                    100.0 * ideal.as_secs_f64() / res.mean().as_secs_f64()
+                );
+                match res.cache_misses_per_block {
+                    Some(misses) => println!(", {:.0} cache misses/block", misses),
+                    None => println!(),
+                }
+                let late = res
+                    .block_times
+                    .iter()
+                    .filter(|&&t| t > block_duration)
+                    .count();
+                if late > 0 {
+                    println!(
+                        "  {} blocks out of {} took longer than realtime",
+                        late,
+                        res.block_times.len()
+                    );
+                }
+            }
+        }
+        stop.store(true, Ordering::Relaxed);
+        if let Some(reloader) = reloader {
+            println!("{} reloads during the runs", reloader.join().unwrap());
+        }
+    });
+}
@@ -0,0 +1,386 @@
+//! Runs many DSP scripts in one process, without any GUI
+//!
+//! Usage: faust_jit_host CONFIG_FILE
+//!
+//! The config file has one setting per line (`#` starts a comment). Relative
+//! paths are relative to the folder of the config file:
+//!
+//! ```text
+//! sample_rate 48000
+//! block 128
+//! threads 4              # workers computing the DSPs
+//! seconds 10             # 0 runs forever
+//! backend null           # or: backend wav OUT_FILE
+//! realtime               # paces the computation to real time
+//! cache DIR              # same as the plugin's LLVM_CACHE_FOLDER
+//! import DIR             # repeatable
+//! dsp NAME SCRIPT [voices N] [input OTHER_NAME] [osc PORT] [notes 60,64,67] [gain G]
+//! ```
+//!
+//! Each `dsp` line creates an instance. Instances of the same script share its
+//! compiled factory. An instance with an `input` is fed the outputs of
+//! another one, and is computed after it. Instances whose outputs aren't used
+//! as inputs are mixed (in stereo) into the output of the backend. Instances
+//! whose dependencies are computed are spread over the worker threads.
+//! Parameters are controlled via OSC (with `osc PORT`), and `notes` holds MIDI
+//! notes for the whole run (for instruments).
+//!
+//! Only the null and wav backends exist for now, the host clocking itself
+//! (`realtime` makes it keep pace with the wall clock so it can be controlled
+//! live). There is no audio device backend: nothing is heard while it runs.
+
+use faust_jit::{Cache, CompileOptions, DspLoadMode, DspMemory, Factory, SingletonDsp};
+use faust_jit_tools::*;
+use std::{
+    collections::HashMap,
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering},
+        Arc, Barrier, Mutex,
+    },
+    time::{Duration, Instant},
+};
+
+struct DspConfig {
+    name: String,
+    script: PathBuf,
+    load_mode: DspLoadMode,
+    input: Option<String>,
+    osc_port: Option<u16>,
+    notes: Vec<u8>,
+    gain: f32,
+}
+
+enum Backend {
+    Null,
+    Wav(PathBuf),
+}
+
+struct HostConfig {
+    sample_rate: i32,
+    block_size: usize,
+    threads: usize,
+    seconds: f64,
+    backend: Backend,
+    realtime: bool,
+    cache: Option<Cache>,
+    import_paths: Vec<PathBuf>,
+    dsps: Vec<DspConfig>,
+}
+
+impl HostConfig {
+    fn read(path: &Path) -> Result<Self, String> {
+        let text = std::fs::read_to_string(path)
+            .map_err(|e| format!("Cannot read {}: {}", path.display(), e))?;
+        let folder = path.parent().unwrap_or(Path::new("."));
+        let mut config = Self {
+            sample_rate: 48000,
+            block_size: 128,
+            threads: 1,
+            seconds: 10.0,
+            backend: Backend::Null,
+            realtime: false,
+            cache: None,
+            import_paths: vec![env!("DSP_LIBS_PATH").into()],
+            dsps: vec![],
+        };
+        for (line_num, line) in text.lines().enumerate() {
+            let line = line.split('#').next().unwrap_or_default();
+            let words: Vec<&str> = line.split_whitespace().collect();
+            config
+                .read_line(folder, &words)
+                .map_err(|e| format!("{}:{}: {}", path.display(), line_num + 1, e))?;
+        }
+        if config.dsps.is_empty() {
+            return Err("No dsp declared".into());
+        }
+        Ok(config)
+    }
+
+    fn read_line(&mut self, folder: &Path, words: &[&str]) -> Result<(), String> {
+        fn parse<T: std::str::FromStr>(s: Option<&&str>) -> Result<T, String> {
+            let s = s.ok_or("Missing value")?;
+            s.parse().map_err(|_| format!("Invalid value: {}", s))
+        }
+        match words {
+            [] => {}
+            ["sample_rate", rest @ ..] => self.sample_rate = parse(rest.first())?,
+            ["block", rest @ ..] => self.block_size = parse(rest.first())?,
+            ["threads", rest @ ..] => self.threads = parse::<usize>(rest.first())?.max(1),
+            ["seconds", rest @ ..] => self.seconds = parse(rest.first())?,
+            ["realtime"] => self.realtime = true,
+            ["backend", "null"] => self.backend = Backend::Null,
+            ["backend", "wav", file] => self.backend = Backend::Wav(folder.join(file)),
+            ["cache", dir] => self.cache = Some(Cache::new(folder.join(dir))),
+            ["import", dir] => self.import_paths.push(folder.join(dir)),
+            ["dsp", name, script, options @ ..] => {
+                let mut dsp = DspConfig {
+                    name: name.to_string(),
+                    script: folder.join(script),
+                    load_mode: DspLoadMode::AutoDetect,
+                    input: None,
+                    osc_port: None,
+                    notes: vec![],
+                    gain: 1.0,
+                };
+                for opt in options.chunks(2) {
+                    match opt {
+                        ["voices", n] => dsp.load_mode = DspLoadMode::from_nvoices(parse(Some(n))?),
+                        ["input", other] => dsp.input = Some(other.to_string()),
+                        ["osc", port] => dsp.osc_port = Some(parse(Some(port))?),
+                        ["gain", g] => dsp.gain = parse(Some(g))?,
+                        ["notes", notes] => {
+                            dsp.notes = notes
+                                .split(',')
+                                .map(|n| parse(Some(&n)))
+                                .collect::<Result<_, _>>()?
+                        }
+                        _ => return Err(format!("Invalid dsp option: {}", opt.join(" "))),
+                    }
+                }
+                if self.dsps.iter().any(|d| d.name == dsp.name) {
+                    return Err(format!("Duplicate dsp name: {}", dsp.name));
+                }
+                self.dsps.push(dsp);
+            }
+            _ => return Err(format!("Invalid line: {}", words.join(" "))),
+        }
+        Ok(())
+    }
+}
+
+/// An instance and the buffers it computes in place
+struct Node {
+    name: String,
+    dsp: SingletonDsp,
+    bufs: Mutex<Vec<Vec<f32>>>,
+    input: Option<usize>,
+    gain: f32,
+    /// Whether its outputs go to the backend
+    to_master: bool,
+    compute_nanos: AtomicU64,
+}
+
+impl Node {
+    fn compute(&self, nodes: &[Node]) {
+        let mut bufs = self.bufs.lock().unwrap();
+        match self.input {
+            // Inputs are computed at an earlier level, so nobody is holding
+            // their lock anymore
+            Some(i) => {
+                let source = nodes[i].bufs.lock().unwrap();
+                let source_outs = nodes[i].dsp.info.num_outputs as usize;
+                for (c, buf) in bufs.iter_mut().enumerate() {
+                    if source_outs > 0 {
+                        buf.copy_from_slice(&source[c % source_outs]);
+                    } else {
+                        buf.fill(0.0);
+                    }
+                }
+            }
+            None => bufs.iter_mut().for_each(|b| b.fill(0.0)),
+        }
+        let mut slices: Vec<&mut [f32]> = bufs.iter_mut().map(|b| b.as_mut_slice()).collect();
+        let start = Instant::now();
+        self.dsp.process_buffers(&mut slices);
+        self.compute_nanos
+            .fetch_add(start.elapsed().as_nanos() as u64, Ordering::Relaxed);
+    }
+}
+
+/// Loads the instances, sharing factories between instances of the same
+/// script, and sorts them in levels: a node is computed after its input
+fn load_nodes(config: &HostConfig) -> Result<(Vec<Node>, Vec<Vec<usize>>), String> {
+    let import_paths: Vec<&Path> = config.import_paths.iter().map(|p| p.as_path()).collect();
+    let options = CompileOptions::default();
+    let mut factories: HashMap<&Path, Arc<Factory>> = HashMap::new();
+    let mut nodes = vec![];
+    for dsp_config in &config.dsps {
+        let factory = match factories.get(dsp_config.script.as_path()) {
+            Some(f) => Arc::clone(f),
+            None => {
+                let f = Arc::new(
+                    Factory::from_file(
+                        config.cache.as_ref(),
+                        &dsp_config.script,
+                        &import_paths,
+                        &options,
+                    )
+                    .map_err(|e| format!("{}: {}", dsp_config.name, e))?,
+                );
+                factories.insert(dsp_config.script.as_path(), Arc::clone(&f));
+                f
+            }
+        };
+        // Without a deadline, page faults don't matter but unused memory does
+        let memory = if config.realtime {
+            DspMemory::Prefaulted
+        } else {
+            DspMemory::Lazy
+        };
+        let dsp =
+            SingletonDsp::from_factory(&factory, config.sample_rate, &dsp_config.load_mode, memory);
+        for &note in &dsp_config.notes {
+            dsp.handle_raw_midi(0.0, [0x90, note, 100]);
+        }
+        if let Some(port) = dsp_config.osc_port {
+            let addr = dsp.start_osc(port)?;
+            println!("{}: listening for OSC on {}", dsp_config.name, addr);
+        }
+        let num_chans = dsp.info.num_inputs.max(dsp.info.num_outputs) as usize;
+        let input = match &dsp_config.input {
+            None => None,
+            Some(other) => Some(
+                config
+                    .dsps
+                    .iter()
+                    .position(|d| &d.name == other)
+                    .ok_or_else(|| format!("{}: unknown input {}", dsp_config.name, other))?,
+            ),
+        };
+        nodes.push(Node {
+            name: dsp_config.name.clone(),
+            dsp,
+            bufs: Mutex::new(vec![vec![0.0; config.block_size]; num_chans]),
+            input,
+            gain: dsp_config.gain,
+            to_master: !config
+                .dsps
+                .iter()
+                .any(|d| d.input.as_ref() == Some(&dsp_config.name)),
+            compute_nanos: AtomicU64::new(0),
+        });
+    }
+
+    let mut levels: Vec<Vec<usize>> = vec![];
+    for i in 0..nodes.len() {
+        let mut level = 0;
+        let mut cur = i;
+        while let Some(input) = nodes[cur].input {
+            level += 1;
+            cur = input;
+            if level > nodes.len() {
+                return Err(format!("{}: its inputs form a cycle", nodes[i].name));
+            }
+        }
+        if levels.len() <= level {
+            levels.resize(level + 1, vec![]);
+        }
+        levels[level].push(i);
+    }
+    Ok((nodes, levels))
+}
+
+fn main() {
+    let args = Args::from_env();
+    let positional = args.positional();
+    let [config_path] = positional.as_slice() else {
+        fail("Expected a config file");
+    };
+    let config = HostConfig::read(Path::new(config_path)).unwrap_or_else(|e| fail(&e));
+    let (nodes, levels) = load_nodes(&config).unwrap_or_else(|e| fail(&e));
+    let wav = match &config.backend {
+        Backend::Null => None,
+        Backend::Wav(path) => Some(
+            WavWriter::create(path, 2, config.sample_rate as u32)
+                .unwrap_or_else(|e| fail(&format!("Cannot create {}: {}", path.display(), e))),
+        ),
+    };
+
+    let total_blocks = if config.seconds > 0.0 {
+        (config.seconds * config.sample_rate as f64 / config.block_size as f64) as usize
+    } else {
+        usize::MAX
+    };
+    let block_duration =
+        Duration::from_secs_f64(config.block_size as f64 / config.sample_rate as f64);
+    // Each level is computed by all the workers, which take its nodes one by
+    // one. They all wait for each other before starting the next level:
+    let next_node: Vec<AtomicUsize> = levels.iter().map(|_| AtomicUsize::new(0)).collect();
+    let barrier = Barrier::new(config.threads);
+    let done = AtomicBool::new(false);
+    let wav = Mutex::new(wav);
+    let master = Mutex::new([
+        vec![0.0f32; config.block_size],
+        vec![0.0f32; config.block_size],
+    ]);
+    let start = Instant::now();
+    let blocks_done = AtomicUsize::new(0);
+
+    std::thread::scope(|scope| {
+        for _ in 0..config.threads {
+            scope.spawn(|| {
+                while !done.load(Ordering::Relaxed) {
+                    for (level, counter) in levels.iter().zip(&next_node) {
+                        loop {
+                            let i = counter.fetch_add(1, Ordering::Relaxed);
+                            match level.get(i) {
+                                Some(&node) => nodes[node].compute(&nodes),
+                                None => break,
+                            }
+                        }
+                        barrier.wait();
+                    }
+                    // The leader mixes, outputs the block and prepares the
+                    // next one while the others wait:
+                    if barrier.wait().is_leader() {
+                        let mut master = master.lock().unwrap();
+                        for chan in master.iter_mut() {
+                            chan.fill(0.0);
+                        }
+                        for node in nodes.iter().filter(|n| n.to_master) {
+                            let bufs = node.bufs.lock().unwrap();
+                            let outs = node.dsp.info.num_outputs as usize;
+                            for (c, chan) in master.iter_mut().enumerate() {
+                                if outs > 0 {
+                                    for (m, s) in chan.iter_mut().zip(&bufs[c % outs]) {
+                                        *m += s * node.gain;
+                                    }
+                                }
+                            }
+                        }
+                        if let Some(wav) = &mut *wav.lock().unwrap() {
+                            wav.write(&[&master[0], &master[1]])
+                                .unwrap_or_else(|e| fail(&e.to_string()));
+                        }
+                        for counter in &next_node {
+                            counter.store(0, Ordering::Relaxed);
+                        }
+                        let blocks = blocks_done.fetch_add(1, Ordering::Relaxed) + 1;
+                        if blocks >= total_blocks {
+                            done.store(true, Ordering::Relaxed);
+                        } else if config.realtime {
+                            let deadline = start + block_duration * blocks as u32;
+                            if let Some(wait) = deadline.checked_duration_since(Instant::now()) {
+                                std::thread::sleep(wait);
+                            }
+                        }
+                    }
+                    barrier.wait();
+                }
+            });
+        }
+    });
+
+    let elapsed = start.elapsed();
+    let blocks = blocks_done.load(Ordering::Relaxed);
+    let audio_secs = (blocks * config.block_size) as f64 / config.sample_rate as f64;
+    for node in &nodes {
+        let secs = node.compute_nanos.load(Ordering::Relaxed) as f64 * 1e-9;
+        println!(
+            "{}: {:.1}% of real time",
+            node.name,
+            100.0 * secs / audio_secs
+        );
+    }
+    println!(
+        "{} instances, {} blocks, {:.1}x real time with {} threads",
+        nodes.len(),
+        blocks,
+        audio_secs / elapsed.as_secs_f64(),
+        config.threads
+    );
+    if let Some(wav) = wav.into_inner().unwrap() {
+        wav.finish().unwrap_or_else(|e| fail(&e.to_string()));
+    }
+}
@@ -0,0 +1,311 @@
+//! Helpers shared by the command-line tools of this crate, which load and run
+//! faust_jit DSPs outside of any host.
+
+pub mod perf;
+
+use faust_jit::{CompileOptions, DspLoadMode, DspMemory, SingletonDsp};
+use perf::{CounterKind, CounterSet, PerfStats};
+use std::{
+    path::{Path, PathBuf},
+    str::FromStr,
+    time::{Duration, Instant},
+};
+
+/// A minimal command-line parser: `--name value` options, repeatable `-I dir`
+/// options, and positional arguments
+pub struct Args {
+    args: Vec<String>,
+}
+
+impl Args {
+    pub fn from_env() -> Self {
+        Self {
+            args: std::env::args().skip(1).collect(),
+        }
+    }
+
+    /// Removes `name` from the args, returning whether it was present
+    pub fn flag(&mut self, name: &str) -> bool {
+        match self.args.iter().position(|a| a == name) {
+            Some(i) => {
+                self.args.remove(i);
+                true
+            }
+            None => false,
+        }
+    }
+
+    /// Removes every `name value` pair from the args, returning the values
+    pub fn values(&mut self, name: &str) -> Vec<String> {
+        let mut values = vec![];
+        while let Some(i) = self.args.iter().position(|a| a == name) {
+            self.args.remove(i);
+            if i < self.args.len() {
+                values.push(self.args.remove(i));
+            } else {
+                fail(&format!("{} expects a value", name));
+            }
+        }
+        values
+    }
+
+    /// Removes the last `name value` pair from the args, and parses the value
+    pub fn value<T: FromStr>(&mut self, name: &str) -> Option<T> {
+        self.values(name).pop().map(|v| {
+            v.parse()
+                .unwrap_or_else(|_| fail(&format!("Invalid value for {}: {}", name, v)))
+        })
+    }
+
+    /// To be called once all the options have been read
+    pub fn positional(self) -> Vec<String> {
+        if let Some(unknown) = self.args.iter().find(|a| a.starts_with("--")) {
+            fail(&format!("Unknown option {}", unknown));
+        }
+        self.args
+    }
+}
+
+pub fn fail(msg: &str) -> ! {
+    eprintln!("{}", msg);
+    std::process::exit(1)
+}
+
+/// Reads the `-I DIR` options, and adds the folder of the Faust libraries (as
+/// configured at build time)
+pub fn import_paths_from_args(args: &mut Args) -> Vec<PathBuf> {
+    let mut import_paths: Vec<PathBuf> = args.values("-I").into_iter().map(PathBuf::from).collect();
+    import_paths.push(env!("DSP_LIBS_PATH").into());
+    import_paths
+}
+
+/// Reads the `--perf` flag (generic hardware counters) and the `--perf-raw
+/// CODE` options (CPU-specific events, in hex). Empty if no counter is asked
+pub fn perf_events_from_args(args: &mut Args) -> Vec<CounterKind> {
+    let raw: Vec<CounterKind> = args
+        .values("--perf-raw")
+        .iter()
+        .map(|code| {
+            u64::from_str_radix(code.trim_start_matches("0x"), 16)
+                .map(CounterKind::Raw)
+                .unwrap_or_else(|_| fail(&format!("Invalid event code for --perf-raw: {}", code)))
+        })
+        .collect();
+    let mut kinds = vec![];
+    if args.flag("--perf") || !raw.is_empty() {
+        kinds.extend(CounterKind::GENERIC);
+    }
+    kinds.extend(raw);
+    kinds
+}
+
+/// Where and how to load scripts from
+pub struct LoadSettings {
+    pub cache: Option<faust_jit::Cache>,
+    pub import_paths: Vec<PathBuf>,
+    pub sample_rate: i32,
+    pub load_mode: DspLoadMode,
+    pub memory: DspMemory,
+}
+
+impl LoadSettings {
+    /// Reads the `--cache DIR`, `-I DIR`, `--sr RATE` and `--voices N` options
+    pub fn from_args(args: &mut Args) -> Self {
+        Self {
+            cache: args.value::<PathBuf>("--cache").map(faust_jit::Cache::new),
+            import_paths: import_paths_from_args(args),
+            sample_rate: args.value("--sr").unwrap_or(48000),
+            load_mode: DspLoadMode::from_nvoices(args.value("--voices").unwrap_or(-1)),
+            memory: DspMemory::default(),
+        }
+    }
+
+    pub fn load(&self, script: &Path, options: &CompileOptions) -> Result<SingletonDsp, String> {
+        let import_paths: Vec<&Path> = self.import_paths.iter().map(|p| p.as_path()).collect();
+        SingletonDsp::from_file(
+            self.cache.as_ref(),
+            script,
+            &import_paths,
+            options,
+            self.sample_rate,
+            &self.load_mode,
+            self.memory,
+        )
+    }
+}
+
+/// How to run a DSP in a benchmark
+pub struct BenchSettings {
+    pub block_size: usize,
+    pub seconds: f64,
+    /// How many MIDI notes are held during the whole run (for instruments)
+    pub held_notes: u8,
+    /// Hardware counters to read around the calls to process_buffers
+    pub perf_events: Vec<CounterKind>,
+}
+
+impl BenchSettings {
+    /// Reads the `--block N`, `--seconds S`, `--notes N`, `--perf` and
+    /// `--perf-raw CODE` options
+    pub fn from_args(args: &mut Args) -> Self {
+        Self {
+            block_size: args.value("--block").unwrap_or(64),
+            seconds: args.value("--seconds").unwrap_or(5.0),
+            held_notes: args.value("--notes").unwrap_or(1),
+            perf_events: perf_events_from_args(args),
+        }
+    }
+}
+
+/// Timings of a benchmark run. Only the calls to process_buffers are timed
+pub struct BenchResult {
+    pub blocks: usize,
+    pub total: Duration,
+    pub worst_block: Duration,
+    /// Duration of the audio that was computed divided by the time it took
+    pub realtime_factor: f64,
+    /// If hardware counters were asked for
+    pub perf: Option<PerfStats>,
+}
+
+impl BenchResult {
+    pub fn ns_per_sample(&self, block_size: usize) -> f64 {
+        self.total.as_nanos() as f64 / (self.blocks * block_size) as f64
+    }
+
+    pub fn report(&self, name: &str, settings: &BenchSettings) {
+        println!(
+            "{}: {:.2} ns/sample, worst block {:.1} us, {:.1}x realtime",
+            name,
+            self.ns_per_sample(settings.block_size),
+            self.worst_block.as_secs_f64() * 1e6,
+            self.realtime_factor
+        );
+        if let Some(perf) = &self.perf {
+            perf.report(name, self.blocks * settings.block_size);
+        }
+    }
+}
+
+/// Fills the buffers with deterministic white noise
+pub struct NoiseGen(u32);
+
+impl NoiseGen {
+    pub fn new() -> Self {
+        Self(0x1234_5678)
+    }
+
+    pub fn fill(&mut self, bufs: &mut [Vec<f32>]) {
+        for buf in bufs {
+            for s in buf.iter_mut() {
+                // Numerical Recipes' LCG
+                self.0 = self.0.wrapping_mul(1664525).wrapping_add(1013904223);
+                *s = (self.0 >> 8) as f32 / (1 << 23) as f32 - 1.0;
+            }
+        }
+    }
+}
+
+/// Sends a note-on for each of the `count` notes that should be held
+pub fn hold_notes(dsp: &SingletonDsp, count: u8) {
+    for i in 0..count {
+        dsp.handle_raw_midi(0.0, [0x90, 48 + i * 3, 100]);
+    }
+}
+
+/// Feeds noise to the DSP and computes it for the configured duration
+pub fn run_bench(dsp: &SingletonDsp, settings: &BenchSettings) -> BenchResult {
+    let num_chans = dsp.info.num_inputs.max(dsp.info.num_outputs) as usize;
+    let mut bufs = vec![vec![0.0f32; settings.block_size]; num_chans];
+    let mut noise = NoiseGen::new();
+    let blocks =
+        (settings.seconds * dsp.info.sample_rate as f64 / settings.block_size as f64) as usize;
+
+    hold_notes(dsp, settings.held_notes);
+    let counters = CounterSet::open(&settings.perf_events);
+    let mut total = Duration::ZERO;
+    let mut worst_block = Duration::ZERO;
+    for _ in 0..blocks {
+        noise.fill(&mut bufs);
+        let mut slices: Vec<&mut [f32]> = bufs.iter_mut().map(|b| b.as_mut_slice()).collect();
+        // The counters are toggled outside of the timed section:
+        counters.resume();
+        let start = Instant::now();
+        dsp.process_buffers(&mut slices);
+        let elapsed = start.elapsed();
+        counters.pause();
+        total += elapsed;
+        worst_block = worst_block.max(elapsed);
+    }
+    BenchResult {
+        blocks,
+        total,
+        worst_block,
+        realtime_factor: (blocks * settings.block_size) as f64
+            / dsp.info.sample_rate as f64
+            / total.as_secs_f64(),
+        perf: (!settings.perf_events.is_empty()).then(|| counters.read()),
+    }
+}
+
+/// Writes interleaved 32-bit float samples to a WAV file
+pub struct WavWriter {
+    file: std::io::BufWriter<std::fs::File>,
+    num_chans: u16,
+    sample_rate: u32,
+    frames: u32,
+}
+
+impl WavWriter {
+    pub fn create(path: &Path, num_chans: u16, sample_rate: u32) -> std::io::Result<Self> {
+        let mut writer = Self {
+            file: std::io::BufWriter::new(std::fs::File::create(path)?),
+            num_chans,
+            sample_rate,
+            frames: 0,
+        };
+        writer.write_header()?;
+        Ok(writer)
+    }
+
+    fn write_header(&mut self) -> std::io::Result<()> {
+        use std::io::Write;
+        let block_align = self.num_chans as u32 * 4;
+        let data_size = self.frames * block_align;
+        let f = &mut self.file;
+        f.write_all(b"RIFF")?;
+        f.write_all(&(36 + data_size).to_le_bytes())?;
+        f.write_all(b"WAVEfmt ")?;
+        f.write_all(&16u32.to_le_bytes())?;
+        f.write_all(&3u16.to_le_bytes())?; // IEEE float
+        f.write_all(&self.num_chans.to_le_bytes())?;
+        f.write_all(&self.sample_rate.to_le_bytes())?;
+        f.write_all(&(self.sample_rate * block_align).to_le_bytes())?;
+        f.write_all(&(block_align as u16).to_le_bytes())?;
+        f.write_all(&32u16.to_le_bytes())?;
+        f.write_all(b"data")?;
+        f.write_all(&data_size.to_le_bytes())
+    }
+
+    /// `chans` must contain `num_chans` slices of the same length
+    pub fn write(&mut self, chans: &[&[f32]]) -> std::io::Result<()> {
+        use std::io::Write;
+        let len = chans.first().map_or(0, |c| c.len());
+        for i in 0..len {
+            for chan in chans {
+                self.file.write_all(&chan[i].to_le_bytes())?;
+            }
+        }
+        self.frames += len as u32;
+        Ok(())
+    }
+
+    /// Writes the final sizes in the header
+    pub fn finish(mut self) -> std::io::Result<()> {
+        use std::io::{Seek, SeekFrom, Write};
+        self.file.flush()?;
+        self.file.seek(SeekFrom::Start(0))?;
+        self.write_header()?;
+        self.file.flush()
+    }
+}
@@ -0,0 +1,76 @@
+//! Precompiles a library of DSP scripts into a pack, i.e. a folder with the
+//! same layout as a faust_jit cache, meant to be installed on other machines
+//! as a read-only cache layer
+//!
+//! Usage: faust_jit_pack PACK_DIR SCRIPT_OR_DIR... [-I DIR]... [--native]
+//!
+//! Folders are searched recursively for .dsp files. By default, scripts are
+//! compiled for a baseline CPU so the pack works on any machine of the same
+//! architecture (and the plugin upgrades them to native builds on first load).
+//! `--native` compiles them for this exact machine instead, which is only
+//! useful if the pack is to be used on identical machines. The other options
+//! must match the ones the pack will be looked up with: the plugin uses the
+//! default ones.
+
+use faust_jit::{Cache, CompileOptions, MachineTarget, OptLevel, SingletonDsp};
+use faust_jit_tools::*;
+use std::path::{Path, PathBuf};
+
+fn main() {
+    let mut args = Args::from_env();
+    let import_paths = import_paths_from_args(&mut args);
+    let options = CompileOptions {
+        target: if args.flag("--native") {
+            MachineTarget::Native
+        } else {
+            MachineTarget::Portable
+        },
+        opt_level: OptLevel::Full,
+    };
+    let mut positional = args.positional().into_iter();
+    let Some(pack_dir) = positional.next() else {
+        fail("Expected a pack folder and at least one script or folder of scripts");
+    };
+    let mut scripts = vec![];
+    for p in positional {
+        collect_scripts(Path::new(&p), &mut scripts);
+    }
+    if scripts.is_empty() {
+        fail("No .dsp script found");
+    }
+
+    let pack = Cache::new(PathBuf::from(pack_dir));
+    let mut failures = 0;
+    for script in &scripts {
+        // The folder of each script is added by faust_jit itself
+        let import_paths: Vec<&Path> = import_paths.iter().map(|p| p.as_path()).collect();
+        match SingletonDsp::compile_to_cache(&pack, script, &import_paths, &options) {
+            Ok(()) => println!("ok: {}", script.display()),
+            Err(e) => {
+                failures += 1;
+                println!("FAILED: {}\n{}", script.display(), e);
+            }
+        }
+    }
+    println!("{} scripts, {} failed", scripts.len(), failures);
+    if failures > 0 {
+        std::process::exit(1);
+    }
+}
+
+fn collect_scripts(path: &Path, scripts: &mut Vec<PathBuf>) {
+    if path.is_dir() {
+        let mut entries: Vec<PathBuf> = std::fs::read_dir(path)
+            .unwrap_or_else(|e| fail(&format!("Cannot read {}: {}", path.display(), e)))
+            .filter_map(|entry| entry.ok().map(|e| e.path()))
+            .collect();
+        entries.sort();
+        for entry in entries {
+            collect_scripts(&entry, scripts);
+        }
+    } else if path.extension().is_some_and(|ext| ext == "dsp") {
+        scripts.push(path.to_owned());
+    } else if !path.exists() {
+        fail(&format!("{} does not exist", path.display()));
+    }
+}
@@ -0,0 +1,245 @@
+//! Hardware performance counters of the calling thread, read through Linux's
+//! perf_event_open. On other OSes (or if the kernel forbids it, see
+//! `/proc/sys/kernel/perf_event_paranoid`), counters just can't be opened.
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum CounterKind {
+    Cycles,
+    Instructions,
+    /// Misses of the L1 data cache on reads
+    L1dMisses,
+    /// Misses of the last level cache
+    CacheMisses,
+    BranchMisses,
+    /// A CPU-specific event, as given to `perf stat -e rXXXX`. E.g. 0x1eca
+    /// (FP_ASSIST.ANY) counts the floating-point assists on recent Intel CPUs,
+    /// which are mostly caused by denormals
+    Raw(u64),
+}
+
+impl CounterKind {
+    /// The counters every CPU has
+    pub const GENERIC: [CounterKind; 5] = [
+        CounterKind::Cycles,
+        CounterKind::Instructions,
+        CounterKind::L1dMisses,
+        CounterKind::CacheMisses,
+        CounterKind::BranchMisses,
+    ];
+
+    pub fn name(&self) -> String {
+        match self {
+            CounterKind::Cycles => "cycles".into(),
+            CounterKind::Instructions => "instructions".into(),
+            CounterKind::L1dMisses => "L1d misses".into(),
+            CounterKind::CacheMisses => "LLC misses".into(),
+            CounterKind::BranchMisses => "branch misses".into(),
+            CounterKind::Raw(code) => format!("r{:x}", code),
+        }
+    }
+}
+
+/// Counts an event in user space, for the thread that opened it only
+pub struct Counter {
+    #[cfg(target_os = "linux")]
+    fd: i32,
+}
+
+#[cfg(target_os = "linux")]
+mod linux {
+    /// The first version of the struct (PERF_ATTR_SIZE_VER0), which every
+    /// kernel accepts
+    #[repr(C)]
+    #[derive(Default)]
+    pub(super) struct PerfEventAttr {
+        pub typ: u32,
+        pub size: u32,
+        pub config: u64,
+        pub sample_period: u64,
+        pub sample_type: u64,
+        pub read_format: u64,
+        pub flags: u64,
+        pub wakeup_events: u32,
+        pub bp_type: u32,
+        pub config1: u64,
+    }
+
+    pub(super) const PERF_TYPE_HARDWARE: u32 = 0;
+    pub(super) const PERF_TYPE_HW_CACHE: u32 = 3;
+    pub(super) const PERF_TYPE_RAW: u32 = 4;
+    pub(super) const PERF_COUNT_HW_CPU_CYCLES: u64 = 0;
+    pub(super) const PERF_COUNT_HW_INSTRUCTIONS: u64 = 1;
+    pub(super) const PERF_COUNT_HW_CACHE_MISSES: u64 = 3;
+    pub(super) const PERF_COUNT_HW_BRANCH_MISSES: u64 = 5;
+    /// L1D cache, read operation, miss result
+    pub(super) const PERF_COUNT_HW_CACHE_L1D_READ_MISS: u64 = 1 << 16;
+    /// So that the value can be scaled when the kernel multiplexes counters
+    pub(super) const PERF_FORMAT_TOTAL_TIMES: u64 = 1 | 2;
+    pub(super) const FLAG_DISABLED: u64 = 1 << 0;
+    pub(super) const FLAG_EXCLUDE_KERNEL: u64 = 1 << 5;
+    pub(super) const FLAG_EXCLUDE_HV: u64 = 1 << 6;
+}
+
+impl Counter {
+    /// Opens a counter that counts right away
+    pub fn open(kind: CounterKind) -> Option<Self> {
+        Self::open_with(kind, false)
+    }
+
+    fn open_with(kind: CounterKind, disabled: bool) -> Option<Self> {
+        #[cfg(target_os = "linux")]
+        {
+            use linux::*;
+            let (typ, config) = match kind {
+                CounterKind::Cycles => (PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES),
+                CounterKind::Instructions => (PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS),
+                CounterKind::L1dMisses => (PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D_READ_MISS),
+                CounterKind::CacheMisses => (PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES),
+                CounterKind::BranchMisses => (PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES),
+                CounterKind::Raw(code) => (PERF_TYPE_RAW, code),
+            };
+            let attr = PerfEventAttr {
+                typ,
+                size: std::mem::size_of::<PerfEventAttr>() as u32,
+                config,
+                read_format: PERF_FORMAT_TOTAL_TIMES,
+                flags: FLAG_EXCLUDE_KERNEL
+                    | FLAG_EXCLUDE_HV
+                    | if disabled { FLAG_DISABLED } else { 0 },
+                ..Default::default()
+            };
+            // pid 0 and cpu -1: the calling thread, on any CPU
+            let fd = unsafe {
+                libc::syscall(
+                    libc::SYS_perf_event_open,
+                    &attr as *const PerfEventAttr,
+                    0,
+                    -1,
+                    -1,
+                    0,
+                )
+            };
+            (fd >= 0).then_some(Self { fd: fd as i32 })
+        }
+        #[cfg(not(target_os = "linux"))]
+        {
+            let _ = (kind, disabled);
+            None
+        }
+    }
+
+    /// The number of events counted so far. If the kernel had to share the
+    /// hardware counters between more events than they can count at once, this
+    /// is extrapolated from the time the event was actually counted
+    pub fn read(&self) -> u64 {
+        #[cfg(target_os = "linux")]
+        {
+            // Value, time enabled, time running
+            let mut values = [0u64; 3];
+            let n = unsafe { libc::read(self.fd, values.as_mut_ptr() as *mut libc::c_void, 24) };
+            match values {
+                _ if n != 24 => 0,
+                [_, _, 0] => 0,
+                [value, enabled, running] if enabled > running => {
+                    (value as f64 * enabled as f64 / running as f64) as u64
+                }
+                [value, _, _] => value,
+            }
+        }
+        #[cfg(not(target_os = "linux"))]
+        {
+            0
+        }
+    }
+}
+
+impl Drop for Counter {
+    fn drop(&mut self) {
+        #[cfg(target_os = "linux")]
+        unsafe {
+            libc::close(self.fd);
+        }
+    }
+}
+
+/// Several counters, that only count between [`CounterSet::resume`] and
+/// [`CounterSet::pause`], so that only some section of code is measured
+pub struct CounterSet {
+    counters: Vec<(CounterKind, Counter)>,
+}
+
+impl CounterSet {
+    /// The kinds that can't be counted on this machine are left out
+    pub fn open(kinds: &[CounterKind]) -> Self {
+        Self {
+            counters: kinds
+                .iter()
+                .filter_map(|&kind| Some((kind, Counter::open_with(kind, true)?)))
+                .collect(),
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.counters.is_empty()
+    }
+
+    /// Enables every counter of the calling thread, with a single syscall
+    pub fn resume(&self) {
+        #[cfg(target_os = "linux")]
+        if !self.is_empty() {
+            unsafe { libc::prctl(libc::PR_TASK_PERF_EVENTS_ENABLE) };
+        }
+    }
+
+    /// Disables every counter of the calling thread
+    pub fn pause(&self) {
+        #[cfg(target_os = "linux")]
+        if !self.is_empty() {
+            unsafe { libc::prctl(libc::PR_TASK_PERF_EVENTS_DISABLE) };
+        }
+    }
+
+    pub fn read(&self) -> PerfStats {
+        PerfStats {
+            values: self.counters.iter().map(|(k, c)| (*k, c.read())).collect(),
+        }
+    }
+}
+
+/// What a [`CounterSet`] counted
+#[derive(Debug, Clone)]
+pub struct PerfStats {
+    pub values: Vec<(CounterKind, u64)>,
+}
+
+impl PerfStats {
+    pub fn get(&self, kind: CounterKind) -> Option<u64> {
+        self.values
+            .iter()
+            .find(|(k, _)| *k == kind)
+            .map(|(_, v)| *v)
+    }
+
+    /// Instructions per cycle
+    pub fn ipc(&self) -> Option<f64> {
+        let cycles = self.get(CounterKind::Cycles).filter(|c| *c > 0)?;
+        Some(self.get(CounterKind::Instructions)? as f64 / cycles as f64)
+    }
+
+    /// Prints each counter divided by the number of samples computed
+    pub fn report(&self, name: &str, samples: usize) {
+        if self.values.is_empty() {
+            println!("{}: no hardware counter available", name);
+            return;
+        }
+        let mut parts: Vec<String> = self
+            .values
+            .iter()
+            .map(|(k, v)| format!("{:.3} {}", *v as f64 / samples.max(1) as f64, k.name()))
+            .collect();
+        if let Some(ipc) = self.ipc() {
+            parts.push(format!("IPC {:.2}", ipc));
+        }
+        println!("{} (per sample): {}", name, parts.join(", "));
+    }
+}
@@ -0,0 +1,172 @@
+//! Replays a session recorded by the plugin against a script, and measures how
+//! much time each block takes
+//!
+//! Usage: faust_jit_replay RECORDING SCRIPT [-I DIR]... [--cache DIR]
+//!            [--voices N] [--portable]
+//!            [--quick] [--wav OUT.wav] [--perf] [--perf-raw CODE]...
+//!
+//! The DSP is fed exactly what the plugin's DSP was fed (input audio, MIDI,
+//! transport, parameter changes, block sizes), at the recorded sample rate and
+//! with the recorded number of voices unless `--voices` is given. Parameters
+//! are matched by path, so the script may differ from the recorded one. The
+//! blocks are computed as fast as possible, and the percentiles of their cost
+//! are reported against the real-time budget of each block.
+//!
+//! With `--wav`, the output is written to a file. Two replays with the same
+//! script and options give the same output, so e.g. the outputs of two builds
+//! can be compared to check that an optimization is neutral.
+//!
+//! `--perf` and `--perf-raw` read hardware counters around the calls to the
+//! DSP, as for faust_jit_bench.
+
+use faust_jit::{
+    recording::{SessionEvent, SessionReader},
+    CompileOptions, DspLoadMode, DspMemory, MachineTarget, OptLevel,
+};
+use faust_jit_tools::{perf::CounterSet, *};
+use std::{
+    path::PathBuf,
+    time::{Duration, Instant},
+};
+
+fn main() {
+    let mut args = Args::from_env();
+    let cache = args.value::<PathBuf>("--cache").map(faust_jit::Cache::new);
+    let import_paths = import_paths_from_args(&mut args);
+    let nvoices: Option<i32> = args.value("--voices");
+    let wav_path: Option<PathBuf> = args.value("--wav");
+    let perf_events = perf_events_from_args(&mut args);
+    let options = CompileOptions {
+        target: if args.flag("--portable") {
+            MachineTarget::Portable
+        } else {
+            MachineTarget::Native
+        },
+        opt_level: if args.flag("--quick") {
+            OptLevel::Quick
+        } else {
+            OptLevel::Full
+        },
+    };
+    let positional = args.positional();
+    let [recording, script] = positional.as_slice() else {
+        fail("Expected a recording and a DSP script");
+    };
+
+    let mut reader = SessionReader::open(recording.as_ref()).unwrap_or_else(|e| fail(&e));
+    let settings = LoadSettings {
+        cache,
+        import_paths,
+        sample_rate: reader.sample_rate,
+        load_mode: DspLoadMode::from_nvoices(nvoices.unwrap_or(reader.nvoices)),
+        memory: DspMemory::default(),
+    };
+    let dsp = settings
+        .load(script.as_ref(), &options)
+        .unwrap_or_else(|e| fail(&e));
+    let num_outputs = dsp.info.num_outputs as usize;
+    let mut wav = wav_path.map(|path| {
+        WavWriter::create(&path, num_outputs as u16, reader.sample_rate as u32)
+            .unwrap_or_else(|e| fail(&format!("{}: {}", path.display(), e)))
+    });
+
+    let counters = CounterSet::open(&perf_events);
+    let dsp_paths = dsp.param_paths();
+    // For each index of the current recorded table, the index in the DSP
+    let mut param_map: Vec<Option<usize>> = vec![];
+    let mut unmatched = 0;
+    let mut block_times = vec![];
+    let mut late_blocks = 0;
+    let mut total_samples = 0;
+    loop {
+        let event = match reader.next_event() {
+            Ok(Some(event)) => event,
+            Ok(None) => break,
+            Err(e) => fail(&e),
+        };
+        match event {
+            SessionEvent::ParamTable(paths) => {
+                param_map = paths
+                    .iter()
+                    .map(|p| dsp_paths.iter().position(|q| q == p))
+                    .collect();
+                unmatched = param_map.iter().filter(|i| i.is_none()).count();
+            }
+            SessionEvent::Param { index, value } => {
+                if let Some(Some(i)) = param_map.get(index) {
+                    dsp.set_param(*i, value);
+                }
+            }
+            SessionEvent::Midi {
+                timestamp,
+                midi_data,
+            } => dsp.handle_raw_midi(timestamp, midi_data),
+            SessionEvent::Transport {
+                playing,
+                clock_data,
+            } => dsp.handle_midi_sync(playing, &clock_data),
+            SessionEvent::Block(mut chans) => {
+                let samples = chans.first().map_or(0, |c| c.len());
+                if samples == 0 {
+                    continue;
+                }
+                // In case the recorded DSP had fewer channels:
+                let needed = dsp.info.num_inputs.max(dsp.info.num_outputs) as usize;
+                if chans.len() < needed {
+                    chans.resize(needed, vec![0.0; samples]);
+                }
+                let mut slices: Vec<&mut [f32]> =
+                    chans.iter_mut().map(|c| c.as_mut_slice()).collect();
+                counters.resume();
+                let start = Instant::now();
+                dsp.process_buffers(&mut slices);
+                let elapsed = start.elapsed();
+                counters.pause();
+                block_times.push(elapsed);
+                if elapsed.as_secs_f64() > samples as f64 / reader.sample_rate as f64 {
+                    late_blocks += 1;
+                }
+                total_samples += samples;
+                if let Some(wav) = &mut wav {
+                    let outputs: Vec<&[f32]> =
+                        chans[..num_outputs].iter().map(|c| c.as_slice()).collect();
+                    wav.write(&outputs).unwrap_or_else(|e| fail(&e.to_string()));
+                }
+            }
+        }
+    }
+    if let Some(wav) = wav {
+        wav.finish().unwrap_or_else(|e| fail(&e.to_string()));
+    }
+    if block_times.is_empty() {
+        fail("No block in the recording");
+    }
+
+    if unmatched > 0 {
+        println!(
+            "{} recorded parameters don't exist in the script and were ignored",
+            unmatched
+        );
+    }
+    let total: Duration = block_times.iter().sum();
+    block_times.sort();
+    let percentile = |p: f64| block_times[((block_times.len() - 1) as f64 * p).round() as usize];
+    let us = |d: Duration| d.as_secs_f64() * 1e6;
+    println!(
+        "{} blocks ({:.1} s of audio): {:.2} ns/sample, p50 {:.1} us, p99 {:.1} us, max {:.1} us",
+        block_times.len(),
+        total_samples as f64 / reader.sample_rate as f64,
+        total.as_nanos() as f64 / total_samples as f64,
+        us(percentile(0.5)),
+        us(percentile(0.99)),
+        us(*block_times.last().unwrap())
+    );
+    println!(
+        "{} blocks took longer than real time, {:.1}x realtime overall",
+        late_blocks,
+        total_samples as f64 / reader.sample_rate as f64 / total.as_secs_f64()
+    );
+    if !perf_events.is_empty() {
+        counters.read().report("counters", total_samples);
+    }
+}
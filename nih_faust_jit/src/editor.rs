@@ -2,20 +2,38 @@ use nih_plug::prelude::*;
 use nih_plug_egui::egui;
 use std::sync::{Arc, RwLock};
 
-use crate::{DspState, DspType};
+use crate::{ComparisonState, DspState, DspType};
 
 /// Data shared between the plugin and the GUI thread
 pub(crate) struct EditorArcs {
     pub(crate) nih_egui_state: Arc<nih_plug_egui::EguiState>,
     pub(crate) selected_paths: Arc<RwLock<crate::SelectedPaths>>,
     pub(crate) dsp_state: Arc<RwLock<DspState>>,
+    pub(crate) comparison: Arc<RwLock<ComparisonState>>,
+    pub(crate) quick_build_since: Arc<RwLock<Option<std::time::SystemTime>>>,
+    pub(crate) quick_reload: Arc<RwLock<bool>>,
+    pub(crate) optimize_delay: Arc<RwLock<f32>>,
     pub(crate) dsp_nvoices: Arc<RwLock<i32>>,
+    pub(crate) offline_nvoices: Arc<RwLock<i32>>,
+    pub(crate) load_governor: Arc<RwLock<bool>>,
+    pub(crate) governor_high_load: Arc<RwLock<f32>>,
+    pub(crate) governor_min_voices: Arc<RwLock<u32>>,
+    pub(crate) cpu_budget: Arc<RwLock<f32>>,
+    pub(crate) refuse_over_budget: Arc<RwLock<bool>>,
+    pub(crate) osc_port: Arc<RwLock<u16>>,
+    pub(crate) recorder: Arc<faust_jit::recording::RecorderControl>,
 }
 
 /// Data owned only by the GUI thread
 struct EditorState {
     script_dialog: Option<egui_file::FileDialog>,
     lib_path_dialog: Option<egui_file::FileDialog>,
+    /// Where the current (or last) session recording is written, or why it
+    /// couldn't be
+    recording_status: Option<String>,
+    /// How variant B is compiled when comparing builds
+    variant_b_options: faust_jit::CompileOptions,
+    variant_b_dialog: Option<egui_file::FileDialog>,
 }
 
 impl Default for EditorState {
@@ -23,6 +41,9 @@ impl Default for EditorState {
         Self {
             script_dialog: None,
             lib_path_dialog: None,
+            recording_status: None,
+            variant_b_options: faust_jit::CompileOptions::default(),
+            variant_b_dialog: None,
         }
     }
 }
@@ -123,11 +144,178 @@ fn top_panel_contents(
                     nvoices = 1;
                 }
                 ui.add(egui::Slider::new(&mut nvoices, 1..=32).text("voices"));
+                let mut offline_nvoices = *arcs.offline_nvoices.read().unwrap();
+                ui.add(egui::Slider::new(&mut offline_nvoices, 0..=128).text("voices when rendering offline"))
+                    .on_hover_text("Used instead when the host bounces the project. 0 means the same number of voices as for realtime playback");
+                *arcs.offline_nvoices.write().unwrap() = offline_nvoices;
             }
         }
     });
     *arcs.dsp_nvoices.write().unwrap() = nvoices;
 
+    // Setting whether polyphony should be reduced under CPU pressure:
+
+    ui.horizontal(|ui| {
+        let mut load_governor = *arcs.load_governor.read().unwrap();
+        let mut high_load = *arcs.governor_high_load.read().unwrap();
+        let mut min_voices = *arcs.governor_min_voices.read().unwrap();
+        let mut changed = ui
+            .checkbox(&mut load_governor, "Steal voices under CPU pressure")
+            .on_hover_text("Lowers the number of notes that can be held when the DSP gets close to not keeping up with real time, and raises it back when there is headroom again")
+            .changed();
+        if load_governor {
+            ui.label("above");
+            changed |= ui
+                .add(
+                    egui::DragValue::new(&mut high_load)
+                        .clamp_range(10.0..=100.0)
+                        .suffix("% load"),
+                )
+                .changed();
+            ui.label("down to");
+            changed |= ui
+                .add(
+                    egui::DragValue::new(&mut min_voices)
+                        .clamp_range(1..=64)
+                        .suffix(" voices"),
+                )
+                .changed();
+        }
+        *arcs.load_governor.write().unwrap() = load_governor;
+        *arcs.governor_high_load.write().unwrap() = high_load;
+        *arcs.governor_min_voices.write().unwrap() = min_voices;
+        if let DspState::Loaded(dsp) = &*arcs.dsp_state.read().unwrap() {
+            if changed {
+                dsp.set_governor(
+                    load_governor.then(|| crate::governor_config(high_load, min_voices)),
+                );
+            }
+            let status = dsp.governor_status();
+            ui.label(format!("Load: {:.0}%", status.load * 100.0));
+            if let Some(limit) = status.voice_limit {
+                ui.colored_label(egui::Color32::YELLOW, format!("Voices limited to {}", limit));
+            }
+        }
+    });
+
+    // Setting the CPU budget, against which the cost of a DSP is estimated
+    // when it loads:
+
+    ui.horizontal(|ui| {
+        let mut cpu_budget = *arcs.cpu_budget.read().unwrap();
+        ui.label("CPU budget:");
+        ui.add(
+            egui::DragValue::new(&mut cpu_budget)
+                .clamp_range(0.0..=100.0)
+                .suffix("%"),
+        )
+        .on_hover_text("The share of a core the DSP should take at most with all its voices playing, as estimated by timing it for a few milliseconds when it loads. 0 means no budget");
+        *arcs.cpu_budget.write().unwrap() = cpu_budget;
+        let mut refuse_over_budget = *arcs.refuse_over_budget.read().unwrap();
+        ui.checkbox(&mut refuse_over_budget, "Refuse DSPs over budget")
+            .on_hover_text("Makes a DSP that is estimated to be over budget fail to load (except when rendering offline), instead of just being flagged. Taken into account when the DSP is reloaded");
+        *arcs.refuse_over_budget.write().unwrap() = refuse_over_budget;
+        if let DspState::Loaded(dsp) = &*arcs.dsp_state.read().unwrap() {
+            if let Some(estimate) = dsp.cost_estimate() {
+                let mut text = format!("Estimated load: {:.1}%", estimate.full_load() * 100.0);
+                if estimate.nvoices > 0 {
+                    text += &format!(
+                        " ({:.1}% + {:.1}% per voice x {})",
+                        estimate.idle_load * 100.0,
+                        estimate.voice_load * 100.0,
+                        estimate.nvoices
+                    );
+                }
+                if cpu_budget > 0.0 && estimate.full_load() * 100.0 > cpu_budget {
+                    ui.colored_label(egui::Color32::YELLOW, text + ", over budget");
+                } else {
+                    ui.label(text);
+                }
+            }
+        }
+    });
+
+    // Showing whether the watchdog bypassed the DSP, and resetting it:
+
+    if let DspState::Loaded(dsp) = &*arcs.dsp_state.read().unwrap() {
+        ui.horizontal(|ui| {
+            if ui
+                .button("Reset DSP")
+                .on_hover_text("Clears the internal state of the DSP (delay lines, filters...) and resumes it if it was bypassed")
+                .clicked()
+            {
+                dsp.reset();
+            }
+            if let Some(reason) = dsp.bypass_reason() {
+                ui.colored_label(egui::Color32::LIGHT_RED, format!("Bypassed, as {}", reason));
+            }
+        });
+    }
+
+    // Recording what the DSP is fed, to replay it with faust_jit_replay:
+
+    if let DspState::Loaded(dsp) = &*arcs.dsp_state.read().unwrap() {
+        ui.horizontal(|ui| {
+            arcs.recorder.collect();
+            if !arcs.recorder.is_recording() {
+                if ui
+                    .button("Record session")
+                    .on_hover_text("Records the input audio, MIDI, transport and parameter changes to a file in the temp folder, so they can be replayed outside of the DAW (e.g. to profile the DSP). Best started right after a reload or a reset, so the replay starts from the same DSP state")
+                    .clicked()
+                {
+                    let secs = std::time::SystemTime::now()
+                        .duration_since(std::time::UNIX_EPOCH)
+                        .map_or(0, |d| d.as_secs());
+                    let path = std::env::temp_dir().join(format!("nih-faust-jit-{}.fjrec", secs));
+                    ed_state.recording_status = Some(
+                        match faust_jit::recording::SessionRecorder::create(
+                            &path,
+                            dsp.info.sample_rate,
+                            *arcs.dsp_nvoices.read().unwrap(),
+                        )
+                        .and_then(|r| arcs.recorder.start(r))
+                        {
+                            Ok(()) => format!("Recording to {}", path.display()),
+                            Err(e) => format!("Could not record to {}: {}", path.display(), e),
+                        },
+                    );
+                }
+            } else if ui.button("Stop recording").clicked() {
+                arcs.recorder.stop();
+            }
+            if let Some(status) = &ed_state.recording_status {
+                ui.label(status);
+            }
+            if arcs.recorder.overflowed() {
+                ui.colored_label(
+                    egui::Color32::LIGHT_RED,
+                    "Disk too slow, recording stopped",
+                );
+            }
+        });
+    }
+
+    // Comparing the DSP (A) with another build of it (B):
+
+    if let DspState::Loaded(_) = &*arcs.dsp_state.read().unwrap() {
+        ab_contents(ui, arcs, async_executor, ed_state);
+    }
+
+    // Setting the OSC port (taken into account at the next reload):
+
+    ui.horizontal(|ui| {
+        let mut osc_port = *arcs.osc_port.read().unwrap();
+        ui.label("OSC port:");
+        ui.add(egui::DragValue::new(&mut osc_port))
+            .on_hover_text("UDP port on localhost on which parameters can be set with OSC messages, e.g. /script_name/group/param 0.5. 0 disables OSC. Taken into account when the DSP is reloaded");
+        *arcs.osc_port.write().unwrap() = osc_port;
+        if let DspState::Loaded(dsp) = &*arcs.dsp_state.read().unwrap() {
+            if let Some(addr) = dsp.osc_address() {
+                ui.label(format!("Listening on {}", addr));
+            }
+        }
+    });
+
     let mut selected_paths = arcs.selected_paths.write().unwrap();
 
     // Setting the Faust libraries path:
@@ -167,12 +355,142 @@ fn top_panel_contents(
         dialog.open();
         ed_state.script_dialog = Some(dialog);
     }
+    let quick_reload = *arcs.quick_reload.read().unwrap();
     if let Some(dialog) = &mut ed_state.script_dialog {
         if dialog.show(ui.ctx()).selected() {
             if let Some(file) = dialog.path() {
                 selected_paths.dsp_script = Some(file.to_path_buf());
-                async_executor.execute_background(crate::Tasks::ReloadDsp);
+                async_executor.execute_background(if quick_reload {
+                    crate::Tasks::QuickReloadDsp
+                } else {
+                    crate::Tasks::ReloadDsp
+                });
+            }
+        }
+    }
+
+    // Compiling with less optimizations when reloading, and replacing the quick
+    // build by an optimized one once the script is left untouched:
+
+    ui.horizontal(|ui| {
+        let mut quick_reload = quick_reload;
+        ui.checkbox(&mut quick_reload, "Quick build on reload")
+            .on_hover_text("When reloading a script that has to be compiled, compiles it with fewer optimizations, which is much faster for large scripts. A fully optimized build replaces it once the script has been left untouched for a while");
+        *arcs.quick_reload.write().unwrap() = quick_reload;
+        let mut optimize_delay = *arcs.optimize_delay.read().unwrap();
+        ui.add(
+            egui::DragValue::new(&mut optimize_delay)
+                .clamp_range(0.0..=600.0)
+                .suffix(" s"),
+        )
+        .on_hover_text("How long the script must be left untouched before it is fully optimized");
+        *arcs.optimize_delay.write().unwrap() = optimize_delay;
+
+        // The audio thread asks for the optimized build when it is due
+        if let Some(since) = *arcs.quick_build_since.read().unwrap() {
+            let elapsed = since.elapsed().unwrap_or_default().as_secs_f32();
+            ui.label(format!(
+                "Quick build, optimizing in {:.0} s",
+                (optimize_delay - elapsed).max(0.0)
+            ));
+        }
+    });
+}
+
+fn ab_contents(
+    ui: &mut egui::Ui,
+    arcs: &EditorArcs,
+    async_executor: &AsyncExecutor<crate::NihFaustJit>,
+    ed_state: &mut EditorState,
+) {
+    let mut load_variant_b = None;
+    let mut close_variant_b = false;
+    ui.horizontal(|ui| {
+        // Only read-locked, as the audio thread skips the comparison while it
+        // is write-locked:
+        let comparison = arcs.comparison.read().unwrap();
+        match &*comparison {
+            ComparisonState::Loaded(ab) => {
+                ui.label("A/B:");
+                let mut listen_b = ab.listening_b();
+                ui.selectable_value(&mut listen_b, false, "A");
+                ui.selectable_value(&mut listen_b, true, "B");
+                ab.set_listen_b(listen_b);
+                let mut compute_both = ab.computing_both();
+                ui.checkbox(&mut compute_both, "Compute both")
+                    .on_hover_text("Also computes the silent variant, on a copy of the input, to measure the difference between both outputs. Otherwise the silent variant is paused, and resumes from where it was when switching to it");
+                ab.set_compute_both(compute_both);
+                let stats = ab.stats();
+                let load = |l: Option<f32>| l.map_or("-".into(), |l| format!("{:.1}%", l * 100.0));
+                ui.label(format!("Load: A {}, B {}", load(stats.load_a), load(stats.load_b)));
+                if compute_both {
+                    match stats.difference_db {
+                        Some(_) if stats.bit_identical => ui.label("Outputs are bit-identical"),
+                        Some(db) => ui.label(format!("Difference: {:.1} dB", db)),
+                        None => ui.label(""),
+                    };
+                }
+                if ui.button("Close B").clicked() {
+                    close_variant_b = true;
+                }
+            }
+            ComparisonState::Loading => {
+                ui.label("Compiling variant B...");
+            }
+            ComparisonState::NoVariantB | ComparisonState::Failed(_) => {
+                ui.label("Compare with a build using:");
+                let mut quick = ed_state.variant_b_options.opt_level == faust_jit::OptLevel::Quick;
+                ui.checkbox(&mut quick, "quick build");
+                ed_state.variant_b_options.opt_level = if quick {
+                    faust_jit::OptLevel::Quick
+                } else {
+                    faust_jit::OptLevel::Full
+                };
+                let mut portable =
+                    ed_state.variant_b_options.target == faust_jit::MachineTarget::Portable;
+                ui.checkbox(&mut portable, "portable target");
+                ed_state.variant_b_options.target = if portable {
+                    faust_jit::MachineTarget::Portable
+                } else {
+                    faust_jit::MachineTarget::Native
+                };
+                let selected_paths = arcs.selected_paths.read().unwrap();
+                if ui
+                    .button("Same script")
+                    .on_hover_text("Loads the current script with these options as variant B. Parameters of A are copied to B, and notes are sent to both")
+                    .clicked()
+                {
+                    load_variant_b = selected_paths.dsp_script.clone();
+                }
+                if ui.button("Other script").clicked() {
+                    let presel = selected_paths
+                        .dsp_script
+                        .as_ref()
+                        .unwrap_or(&selected_paths.dsp_lib_path);
+                    let mut dialog = egui_file::FileDialog::open_file(Some(presel.clone()));
+                    dialog.open();
+                    ed_state.variant_b_dialog = Some(dialog);
+                }
+                if let ComparisonState::Failed(msg) = &*comparison {
+                    ui.colored_label(egui::Color32::LIGHT_RED, "Variant B failed to load")
+                        .on_hover_text(msg);
+                }
             }
         }
+    });
+    if let Some(dialog) = &mut ed_state.variant_b_dialog {
+        if dialog.show(ui.ctx()).selected() {
+            load_variant_b = dialog.path().map(|p| p.to_path_buf());
+        }
+    }
+    if close_variant_b {
+        *arcs.comparison.write().unwrap() = ComparisonState::NoVariantB;
+    }
+    if let Some(script_path) = load_variant_b {
+        *arcs.comparison.write().unwrap() = ComparisonState::Loading;
+        async_executor.execute_background(crate::Tasks::LoadVariantB {
+            script_path,
+            options: ed_state.variant_b_options.clone(),
+        });
     }
 }
@@ -6,10 +6,26 @@ use nih_plug::{
 use serde::{Deserialize, Serialize};
 use std::{
     path::PathBuf,
-    sync::{atomic::Ordering, Arc, RwLock},
+    sync::{
+        atomic::{AtomicBool, AtomicUsize, Ordering},
+        Arc, RwLock,
+    },
+    time::SystemTime,
 };
 
 mod editor;
+mod output_stage;
+
+/// Within a block, MIDI CCs (and pitch bends...) for the same controller that
+/// are closer than that many samples are coalesced. This bounds the work done
+/// per block for controllers that stream at a high rate
+const CONTROL_RESOLUTION: u32 = 32;
+
+/// A new DSP computes that many blocks on the background thread before it
+/// replaces the current one (about 85ms of audio at 48kHz). Half of them are
+/// timed to estimate its cost
+const WARM_UP_BLOCKS: usize = 64;
+const WARM_UP_BLOCK_SIZE: usize = 64;
 
 #[derive(Debug)]
 enum DspState {
@@ -18,6 +34,16 @@ enum DspState {
     Failed(String),
 }
 
+/// The other build of the DSP, when comparing two of them (see
+/// [`faust_jit::ab`])
+#[derive(Debug)]
+enum ComparisonState {
+    NoVariantB,
+    Loading,
+    Loaded(faust_jit::ab::AbComparison),
+    Failed(String),
+}
+
 #[derive(Debug, Serialize, Deserialize)]
 pub struct SelectedPaths {
     dsp_script: Option<std::path::PathBuf>,
@@ -26,8 +52,22 @@ pub struct SelectedPaths {
 
 pub struct NihFaustJit {
     sample_rate: Arc<AtomicF32>,
+    /// Whether the host is currently rendering offline (bouncing), in which
+    /// case the DSP is loaded with the offline profile
+    offline: Arc<AtomicBool>,
+    /// The largest block the host will send, so that variant B can compute in
+    /// preallocated buffers
+    max_buffer_size: Arc<AtomicUsize>,
     params: Arc<NihFaustJitParams>,
     dsp_state: Arc<RwLock<DspState>>,
+    comparison: Arc<RwLock<ComparisonState>>,
+    /// When the current DSP went live, if it is a quick build (see
+    /// [`Tasks::QuickReloadDsp`])
+    quick_build_since: Arc<RwLock<Option<SystemTime>>>,
+    /// Recording what the DSP is fed, started and stopped by the GUI thread
+    recorder: faust_jit::recording::RecorderSlot,
+    recorder_control: Arc<faust_jit::recording::RecorderControl>,
+    output_stage: output_stage::OutputStage,
 }
 
 #[derive(Params)]
@@ -35,6 +75,9 @@ struct NihFaustJitParams {
     #[id = "gain"]
     pub gain: FloatParam,
 
+    #[id = "limiter"]
+    pub limiter: BoolParam,
+
     #[persist = "editor-state"]
     nih_egui_state: Arc<nih_plug_egui::EguiState>,
 
@@ -43,6 +86,47 @@ struct NihFaustJitParams {
 
     #[persist = "dsp-nvoices"]
     dsp_nvoices: Arc<RwLock<i32>>,
+
+    /// How many voices an instrument should have when rendering offline. 0
+    /// means the same as dsp_nvoices
+    #[persist = "offline-nvoices"]
+    offline_nvoices: Arc<RwLock<i32>>,
+
+    #[persist = "load-governor"]
+    load_governor: Arc<RwLock<bool>>,
+
+    /// The load (in % of the real-time budget) above which the governor starts
+    /// stealing voices
+    #[persist = "governor-high-load"]
+    governor_high_load: Arc<RwLock<f32>>,
+
+    /// The number of voices the governor always leaves playable
+    #[persist = "governor-min-voices"]
+    governor_min_voices: Arc<RwLock<u32>>,
+
+    /// The share of a core (in %) a DSP should take at most, as estimated when
+    /// it loads. 0 means no budget
+    #[persist = "cpu-budget"]
+    cpu_budget: Arc<RwLock<f32>>,
+
+    /// Whether a DSP over budget should fail to load, instead of just being
+    /// flagged in the editor
+    #[persist = "refuse-over-budget"]
+    refuse_over_budget: Arc<RwLock<bool>>,
+
+    /// The UDP port (on localhost) on which the DSP's parameters can be
+    /// controlled via OSC. 0 means no OSC
+    #[persist = "osc-port"]
+    osc_port: Arc<RwLock<u16>>,
+
+    /// Whether reloading the script from the editor uses a quick build
+    #[persist = "quick-reload"]
+    quick_reload: Arc<RwLock<bool>>,
+
+    /// How long (in seconds) the script must be left untouched before a quick
+    /// build is replaced by a fully optimized one
+    #[persist = "optimize-delay"]
+    optimize_delay: Arc<RwLock<f32>>,
 }
 
 impl NihFaustJit {
@@ -52,17 +136,37 @@ impl NihFaustJit {
             nih_egui_state: Arc::clone(&self.params.nih_egui_state),
             selected_paths: Arc::clone(&self.params.selected_paths),
             dsp_state: Arc::clone(&self.dsp_state),
+            comparison: Arc::clone(&self.comparison),
+            quick_build_since: Arc::clone(&self.quick_build_since),
+            quick_reload: Arc::clone(&self.params.quick_reload),
+            optimize_delay: Arc::clone(&self.params.optimize_delay),
             dsp_nvoices: Arc::clone(&self.params.dsp_nvoices),
+            offline_nvoices: Arc::clone(&self.params.offline_nvoices),
+            load_governor: Arc::clone(&self.params.load_governor),
+            governor_high_load: Arc::clone(&self.params.governor_high_load),
+            governor_min_voices: Arc::clone(&self.params.governor_min_voices),
+            cpu_budget: Arc::clone(&self.params.cpu_budget),
+            refuse_over_budget: Arc::clone(&self.params.refuse_over_budget),
+            osc_port: Arc::clone(&self.params.osc_port),
+            recorder: Arc::clone(&self.recorder_control),
         }
     }
 }
 
 impl Default for NihFaustJit {
     fn default() -> Self {
+        let (recorder_control, recorder) = faust_jit::recording::recorder_channel();
         Self {
             sample_rate: Arc::new(AtomicF32::new(0.0)),
+            offline: Arc::new(AtomicBool::new(false)),
+            max_buffer_size: Arc::new(AtomicUsize::new(1024)),
             params: Arc::new(NihFaustJitParams::default()),
             dsp_state: Arc::new(RwLock::new(DspState::NoDspScript)),
+            comparison: Arc::new(RwLock::new(ComparisonState::NoVariantB)),
+            quick_build_since: Arc::new(RwLock::new(None)),
+            recorder,
+            recorder_control: Arc::new(recorder_control),
+            output_stage: output_stage::OutputStage::new(1024),
         }
     }
 }
@@ -73,6 +177,8 @@ impl Default for NihFaustJitParams {
             gain: FloatParam::new("Gain", 1.0, FloatRange::Linear { min: 0.0, max: 1.0 })
                 .with_smoother(SmoothingStyle::Linear(50.0)),
 
+            limiter: BoolParam::new("Soft limiter", false),
+
             nih_egui_state: nih_plug_egui::EguiState::from_size(800, 700),
 
             selected_paths: Arc::new(RwLock::new(SelectedPaths {
@@ -81,12 +187,62 @@ impl Default for NihFaustJitParams {
             })),
 
             dsp_nvoices: Arc::new(RwLock::new(-1)),
+
+            offline_nvoices: Arc::new(RwLock::new(0)),
+
+            load_governor: Arc::new(RwLock::new(false)),
+
+            governor_high_load: Arc::new(RwLock::new(80.0)),
+
+            governor_min_voices: Arc::new(RwLock::new(1)),
+
+            cpu_budget: Arc::new(RwLock::new(0.0)),
+
+            refuse_over_budget: Arc::new(RwLock::new(false)),
+
+            osc_port: Arc::new(RwLock::new(0)),
+
+            quick_reload: Arc::new(RwLock::new(true)),
+
+            optimize_delay: Arc::new(RwLock::new(10.0)),
         }
     }
 }
 
+/// The governor settings exposed in the editor. Headroom is considered back
+/// at the same fraction of `high_load_percent` as in the default config
+pub(crate) fn governor_config(
+    high_load_percent: f32,
+    min_voices: u32,
+) -> faust_jit::GovernorConfig {
+    let default = faust_jit::GovernorConfig::default();
+    let high_load = high_load_percent / 100.0;
+    faust_jit::GovernorConfig {
+        high_load,
+        low_load: high_load * default.low_load / default.high_load,
+        min_voices,
+        ..default
+    }
+}
+
 pub enum Tasks {
     ReloadDsp,
+    /// Reloads the DSP with a quick build of the script if it has to be
+    /// compiled, to iterate faster on a script. It is later replaced by a fully
+    /// optimized build with [`Tasks::OptimizeDsp`]
+    QuickReloadDsp,
+    /// Replaces the DSP by a fully optimized build of the script, unless the
+    /// script was modified since the quick build went live (a reload is then
+    /// coming). Asked for by the audio thread once the quick build has been
+    /// live for the optimize delay, so it happens with the editor closed
+    OptimizeDsp {
+        quick_build_since: SystemTime,
+    },
+    /// Loads another build of the DSP, to compare it with the current one
+    LoadVariantB {
+        script_path: PathBuf,
+        options: faust_jit::CompileOptions,
+    },
 }
 
 #[derive(Debug, PartialEq, Eq, Clone, Copy, strum_macros::EnumIter)]
@@ -147,57 +303,313 @@ impl Plugin for NihFaustJit {
         // read later, when it is actually time to load a DSP
 
         let selected_paths_arc = Arc::clone(&self.params.selected_paths);
+        let offline_arc = Arc::clone(&self.offline);
         let dsp_nvoices_arc = Arc::clone(&self.params.dsp_nvoices);
+        let offline_nvoices_arc = Arc::clone(&self.params.offline_nvoices);
+        let load_governor_arc = Arc::clone(&self.params.load_governor);
+        let governor_high_load_arc = Arc::clone(&self.params.governor_high_load);
+        let governor_min_voices_arc = Arc::clone(&self.params.governor_min_voices);
+        let cpu_budget_arc = Arc::clone(&self.params.cpu_budget);
+        let refuse_over_budget_arc = Arc::clone(&self.params.refuse_over_budget);
+        let osc_port_arc = Arc::clone(&self.params.osc_port);
         let dsp_state_arc = Arc::clone(&self.dsp_state);
+        let comparison_arc = Arc::clone(&self.comparison);
+        let quick_build_since_arc = Arc::clone(&self.quick_build_since);
+        let max_buffer_size_arc = Arc::clone(&self.max_buffer_size);
 
         let cache_folder = env!("LLVM_CACHE_FOLDER"); // Build-time env var
+        let cache_packs = env!("LLVM_CACHE_PACKS"); // Build-time env var
+        let lock_dsp_memory = !env!("LOCK_DSP_MEMORY").is_empty(); // Build-time env var
         let opt_cache = if cache_folder.is_empty() {
             None
         } else {
             log!(Level::Info, "Caching llvm bytecode in {}", cache_folder);
-            Some(faust_jit::Cache::new(PathBuf::from(cache_folder)))
+            let packs: Vec<PathBuf> = std::env::split_paths(cache_packs)
+                .filter(|p| !p.as_os_str().is_empty())
+                .collect();
+            if !packs.is_empty() {
+                log!(Level::Info, "Using precompiled packs {:?}", packs);
+            }
+            Some(faust_jit::Cache::new(PathBuf::from(cache_folder)).with_read_only_layers(packs))
         };
 
-        Box::new(move |task| match task {
-            Tasks::ReloadDsp => {
-                let sample_rate = sample_rate_arc.load(Ordering::Relaxed);
-                let selected_paths = selected_paths_arc.read().unwrap();
-                let dsp_nvoices = *dsp_nvoices_arc.read().unwrap();
-                let new_dsp_state = match &selected_paths.dsp_script {
-                    Some(script_path) => {
-                        match faust_jit::SingletonDsp::from_file(
-                            opt_cache.as_ref(),
-                            script_path,
-                            &[&selected_paths.dsp_lib_path],
-                            sample_rate as i32,
-                            &faust_jit::DspLoadMode::from_nvoices(dsp_nvoices),
-                        ) {
-                            Err(msg) => DspState::Failed(msg),
-                            Ok(dsp) => {
-                                if dsp.info.num_inputs <= 2 && dsp.info.num_outputs <= 2 {
-                                    DspState::Loaded(dsp)
+        Box::new(move |task| {
+            let sample_rate = sample_rate_arc.load(Ordering::Relaxed);
+            let selected_paths = selected_paths_arc.read().unwrap();
+            let offline = offline_arc.load(Ordering::Relaxed);
+            let mut dsp_nvoices = *dsp_nvoices_arc.read().unwrap();
+            // Offline profile: when bouncing, there is no deadline, so
+            // instruments can get more voices and the load governor is
+            // pointless:
+            let offline_nvoices = *offline_nvoices_arc.read().unwrap();
+            if offline && dsp_nvoices > 0 && offline_nvoices > 0 {
+                dsp_nvoices = offline_nvoices;
+            }
+            let opt_governor = (*load_governor_arc.read().unwrap() && !offline).then(|| {
+                governor_config(
+                    *governor_high_load_arc.read().unwrap(),
+                    *governor_min_voices_arc.read().unwrap(),
+                )
+            });
+            // Offline, there is no deadline to miss:
+            let max_load = (*refuse_over_budget_arc.read().unwrap() && !offline)
+                .then(|| *cpu_budget_arc.read().unwrap() / 100.0)
+                .filter(|budget| *budget > 0.0);
+            // Page faults only matter when there is a deadline:
+            let memory = if offline {
+                faust_jit::DspMemory::Lazy
+            } else if lock_dsp_memory {
+                faust_jit::DspMemory::Locked
+            } else {
+                faust_jit::DspMemory::Prefaulted
+            };
+            let load_dsp = |script_path: &PathBuf, options: &faust_jit::CompileOptions| {
+                // Unless it's cached (and thus known to be valid), the
+                // script is checked first, so errors are reported
+                // without going through a full compilation:
+                let cached = opt_cache.as_ref().is_some_and(|cache| {
+                    faust_jit::SingletonDsp::is_cached(cache, script_path, options).unwrap_or(false)
+                });
+                if !cached {
+                    if let Err(errors) =
+                        faust_jit::check_script(script_path, &[&selected_paths.dsp_lib_path])
+                    {
+                        let msgs: Vec<String> = errors.iter().map(|e| e.to_string()).collect();
+                        return DspState::Failed(msgs.join("\n"));
+                    }
+                }
+                match faust_jit::SingletonDsp::from_file(
+                    opt_cache.as_ref(),
+                    script_path,
+                    &[&selected_paths.dsp_lib_path],
+                    options,
+                    sample_rate as i32,
+                    &faust_jit::DspLoadMode::from_nvoices(dsp_nvoices),
+                    memory,
+                ) {
+                    Err(msg) => DspState::Failed(msg),
+                    Ok(dsp) => {
+                        if dsp.info.num_inputs <= 2 && dsp.info.num_outputs <= 2 {
+                            dsp.set_governor(opt_governor);
+                            // Offline, time doesn't matter, only NaNs do:
+                            dsp.set_watchdog(Some(faust_jit::WatchdogConfig {
+                                max_cost_ratio: if offline {
+                                    None
                                 } else {
-                                    DspState::Failed(
-                                        format!("DSP has {} input and {} output channels. Max is 2 for each", dsp.info.num_inputs, dsp.info.num_outputs)
-                                    )
+                                    faust_jit::WatchdogConfig::default().max_cost_ratio
+                                },
+                                ..Default::default()
+                            }));
+                            // Offline, there is no deadline, so nothing is dropped
+                            // but what would be overwritten at the same sample:
+                            dsp.set_control_resolution(if offline {
+                                1
+                            } else {
+                                CONTROL_RESOLUTION
+                            });
+                            let estimate = dsp.warm_up(WARM_UP_BLOCK_SIZE, WARM_UP_BLOCKS);
+                            match (estimate, max_load) {
+                                (Some(estimate), Some(budget)) if estimate.full_load() > budget => {
+                                    DspState::Failed(format!(
+                                        "DSP refused, as its estimated load ({:.1}% of a core with all voices playing) exceeds the budget of {:.1}%",
+                                        estimate.full_load() * 100.0,
+                                        budget * 100.0
+                                    ))
                                 }
+                                _ => DspState::Loaded(dsp),
+                            }
+                        } else {
+                            DspState::Failed(format!(
+                                "DSP has {} input and {} output channels. Max is 2 for each",
+                                dsp.info.num_inputs, dsp.info.num_outputs
+                            ))
+                        }
+                    }
+                }
+            };
+            // Only once the previous DSP has been dropped, as it may be
+            // listening on the same port:
+            let start_osc = |dsp_state: &DspState| {
+                let osc_port = *osc_port_arc.read().unwrap();
+                if let (DspState::Loaded(dsp), true) = (dsp_state, osc_port != 0) {
+                    match dsp.start_osc(osc_port) {
+                        Ok(addr) => log!(Level::Info, "Listening for OSC on {}", addr),
+                        Err(e) => log!(Level::Warn, "Could not listen for OSC: {}", e),
+                    }
+                }
+            };
+            // Compiling can take a while, the current build plays in the
+            // meantime. The new one gets the parameter values it has when the
+            // swap happens
+            let upgrade_dsp = |script_path: &PathBuf, options: &faust_jit::CompileOptions| {
+                let new_dsp_state = load_dsp(script_path, options);
+                match new_dsp_state {
+                    DspState::Loaded(new_dsp) => {
+                        let old_dsp_state = {
+                            let mut dsp_state = dsp_state_arc.write().unwrap();
+                            if let DspState::Loaded(old_dsp) = &*dsp_state {
+                                debug_assert!(
+                                    !new_dsp.shares_code_with(old_dsp),
+                                    "libfaust gave back the build being replaced"
+                                );
+                                new_dsp.copy_params_from(old_dsp);
                             }
+                            std::mem::replace(&mut *dsp_state, DspState::Loaded(new_dsp))
+                        };
+                        let old_comparison = std::mem::replace(
+                            &mut *comparison_arc.write().unwrap(),
+                            ComparisonState::NoVariantB,
+                        );
+                        // Dropped once the audio thread can read the state
+                        // again, as stopping the OSC thread takes a while:
+                        drop((old_dsp_state, old_comparison));
+                        start_osc(&dsp_state_arc.read().unwrap());
+                        log!(Level::Debug, "Upgraded {:?} to {:?}", script_path, options);
+                    }
+                    other => log!(
+                        Level::Warn,
+                        "Keeping the current build of {:?}, as the one with {:?} failed: {:?}",
+                        script_path,
+                        options,
+                        other
+                    ),
+                }
+            };
+            let quick = matches!(task, Tasks::QuickReloadDsp);
+            match task {
+                Tasks::ReloadDsp | Tasks::QuickReloadDsp => {
+                    let native = faust_jit::CompileOptions::default();
+                    let portable = faust_jit::CompileOptions {
+                        target: faust_jit::MachineTarget::Portable,
+                        ..native.clone()
+                    };
+                    // If the cache only has a portable build of the script (e.g.
+                    // the cache folder comes from another machine), we start with
+                    // it as it loads instantly, and upgrade to a native build
+                    // afterwards:
+                    let upgrade_to_native = match (&opt_cache, &selected_paths.dsp_script) {
+                        (Some(cache), Some(script_path)) => {
+                            let cached = |options| {
+                                faust_jit::SingletonDsp::is_cached(cache, script_path, options)
+                                    .unwrap_or(false)
+                            };
+                            !cached(&native) && cached(&portable)
                         }
+                        _ => false,
+                    };
+                    // A quick build only saves time if the script has to be
+                    // compiled:
+                    let quick_build = quick
+                        && !offline
+                        && !upgrade_to_native
+                        && !selected_paths
+                            .dsp_script
+                            .as_ref()
+                            .is_some_and(|script_path| {
+                                opt_cache.as_ref().is_some_and(|cache| {
+                                    faust_jit::SingletonDsp::is_cached(cache, script_path, &native)
+                                        .unwrap_or(false)
+                                })
+                            });
+                    let quick_options = faust_jit::CompileOptions {
+                        opt_level: faust_jit::OptLevel::Quick,
+                        ..native.clone()
+                    };
+                    let new_dsp_state = match &selected_paths.dsp_script {
+                        Some(script_path) if upgrade_to_native => load_dsp(script_path, &portable),
+                        Some(script_path) if quick_build => load_dsp(script_path, &quick_options),
+                        Some(script_path) => load_dsp(script_path, &native),
+                        None => DspState::NoDspScript,
+                    };
+                    log!(
+                        Level::Debug,
+                        "Loaded {:?} with sample_rate={}, nvoices={}, offline={}, portable={}, quick={} => {:?}",
+                        selected_paths,
+                        sample_rate,
+                        dsp_nvoices,
+                        offline,
+                        upgrade_to_native,
+                        quick_build,
+                        new_dsp_state
+                    );
+                    let loaded = matches!(new_dsp_state, DspState::Loaded(_));
+                    // The DSP state is only locked in write mode to swap it with
+                    // the newly loaded one. The old one is dropped once the
+                    // audio thread can read the state again, as stopping its
+                    // OSC thread takes a while:
+                    let old_dsp_state =
+                        std::mem::replace(&mut *dsp_state_arc.write().unwrap(), new_dsp_state);
+                    // Variant B was a build of the previous DSP:
+                    let old_comparison = std::mem::replace(
+                        &mut *comparison_arc.write().unwrap(),
+                        ComparisonState::NoVariantB,
+                    );
+                    drop((old_dsp_state, old_comparison));
+                    // The editor asks for the optimized build once the script
+                    // has been left untouched for a while:
+                    *quick_build_since_arc.write().unwrap() =
+                        (quick_build && loaded).then(SystemTime::now);
+                    start_osc(&dsp_state_arc.read().unwrap());
+
+                    if let (true, Some(script_path)) =
+                        (upgrade_to_native, &selected_paths.dsp_script)
+                    {
+                        upgrade_dsp(script_path, &native);
                     }
-                    None => DspState::NoDspScript,
-                };
-                log!(
-                    Level::Debug,
-                    "Loaded {:?} with sample_rate={}, nvoices={} => {:?}",
-                    selected_paths,
-                    sample_rate,
-                    dsp_nvoices,
-                    new_dsp_state
-                );
-                // This is the only place where the whole DSP state is locked in
-                // write mode, and only so we can swap it with the newly loaded
-                // one:
-                *dsp_state_arc.write().unwrap() = new_dsp_state;
+                }
+                Tasks::OptimizeDsp { quick_build_since } => {
+                    // Unless another quick build went live in the meantime,
+                    // which will ask for its own optimized build:
+                    let replaced = quick_build_since_arc.read().unwrap().is_some();
+                    if let (false, Some(script_path)) = (replaced, &selected_paths.dsp_script) {
+                        let modified = std::fs::metadata(script_path)
+                            .and_then(|m| m.modified())
+                            .is_ok_and(|mtime| mtime > quick_build_since);
+                        if modified {
+                            log!(
+                                Level::Debug,
+                                "Not optimizing {:?}, as it was modified since",
+                                script_path
+                            );
+                        } else {
+                            upgrade_dsp(script_path, &faust_jit::CompileOptions::default());
+                        }
+                    }
+                }
+                Tasks::LoadVariantB {
+                    script_path,
+                    options,
+                } => {
+                    // Loaded with the same sample rate and voices as the
+                    // current DSP, so both are fed and measured alike
+                    let new_comparison = match load_dsp(&script_path, &options) {
+                        DspState::Loaded(variant_b) => {
+                            // The governors would steal voices independently:
+                            variant_b.set_governor(None);
+                            match &*dsp_state_arc.read().unwrap() {
+                                DspState::Loaded(dsp) => match faust_jit::ab::AbComparison::new(
+                                    dsp,
+                                    variant_b,
+                                    max_buffer_size_arc.load(Ordering::Relaxed),
+                                ) {
+                                    Ok(comparison) => ComparisonState::Loaded(comparison),
+                                    Err(msg) => ComparisonState::Failed(msg),
+                                },
+                                _ => ComparisonState::Failed("No DSP to compare with".into()),
+                            }
+                        }
+                        DspState::Failed(msg) => ComparisonState::Failed(msg),
+                        DspState::NoDspScript => ComparisonState::NoVariantB,
+                    };
+                    log!(
+                        Level::Debug,
+                        "Loaded variant B {:?} with {:?} => {:?}",
+                        script_path,
+                        options,
+                        new_comparison
+                    );
+                    *comparison_arc.write().unwrap() = new_comparison;
+                }
             }
         })
     }
@@ -213,6 +625,16 @@ impl Plugin for NihFaustJit {
         // function if you do not need it.
         self.sample_rate
             .store(buffer_config.sample_rate, Ordering::Relaxed);
+        self.output_stage = output_stage::OutputStage::new(buffer_config.max_buffer_size as usize);
+        self.max_buffer_size
+            .store(buffer_config.max_buffer_size as usize, Ordering::Relaxed);
+        // The host reinitializes the plugin when switching between realtime
+        // and offline processing, so this is where the DSP is reloaded with
+        // the matching profile
+        self.offline.store(
+            buffer_config.process_mode == ProcessMode::Offline,
+            Ordering::Relaxed,
+        );
         init_ctx.execute(Tasks::ReloadDsp);
         true
     }
@@ -247,28 +669,78 @@ impl Plugin for NihFaustJit {
                 }),
                 _ => None,
             };
+            let mut recorder = self.recorder.current();
+            if let Some(recorder) = &mut recorder {
+                recorder.record_transport(tp.playing, &opt_clock_data);
+            }
+            // The GUI thread only locks the comparison in write mode to
+            // replace it:
+            let comparison_guard = self.comparison.try_read().ok();
+            let comparison = match comparison_guard.as_deref() {
+                Some(ComparisonState::Loaded(comparison)) => Some(comparison),
+                _ => None,
+            };
             dsp.handle_midi_sync(tp.playing, &opt_clock_data);
+            if let Some(comparison) = comparison {
+                comparison.handle_midi_sync(tp.playing, &opt_clock_data);
+            }
 
             // Handling MIDI events:
             while let Some(midi_event) = process_ctx.next_event() {
                 let time = midi_event.timing() as f64;
                 match midi_event.as_midi() {
                     None | Some(MidiResult::SysEx(_, _)) => { /* We ignore SysEx messages */ }
-                    Some(MidiResult::Basic(bytes)) => dsp.handle_raw_midi(time, bytes),
+                    Some(MidiResult::Basic(bytes)) => {
+                        if let Some(recorder) = &mut recorder {
+                            recorder.record_midi(time, bytes);
+                        }
+                        dsp.handle_raw_midi(time, bytes);
+                        if let Some(comparison) = comparison {
+                            comparison.handle_raw_midi(time, bytes);
+                        }
+                    }
                 }
             }
 
             // Processing audio buffers:
-            dsp.process_buffers(buffer.as_slice());
+            if let Some(recorder) = &mut recorder {
+                recorder.record_block(dsp, buffer.as_slice());
+            }
+            match comparison {
+                Some(comparison) => comparison.process_buffers(dsp, buffer.as_slice()),
+                None => dsp.process_buffers(buffer.as_slice()),
+            }
         }
-        // Applying Gain parameter:
-        for channel_samples in buffer.iter_samples() {
-            let gain = self.params.gain.smoothed.next();
-
-            for sample in channel_samples {
-                *sample *= gain;
+        // Asking for the optimized build once the quick one has been live for
+        // long enough. Checked here, as the editor may be closed. The other
+        // threads only hold these locks briefly:
+        let optimize_due = match (
+            self.quick_build_since.try_read(),
+            self.params.optimize_delay.try_read(),
+        ) {
+            (Ok(since), Ok(delay)) => since
+                .is_some_and(|since| since.elapsed().unwrap_or_default().as_secs_f32() >= *delay),
+            _ => false,
+        };
+        if optimize_due {
+            if let Some(since) = self
+                .quick_build_since
+                .try_write()
+                .ok()
+                .and_then(|mut since| since.take())
+            {
+                process_ctx.execute_background(Tasks::OptimizeDsp {
+                    quick_build_since: since,
+                });
             }
         }
+
+        // Applying Gain parameter, sanitizing and limiting the output:
+        self.output_stage.process(
+            buffer.as_slice(),
+            &self.params.gain.smoothed,
+            self.params.limiter.value(),
+        );
         ProcessStatus::Normal
     }
 }
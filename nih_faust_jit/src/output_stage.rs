@@ -0,0 +1,97 @@
+use nih_plug::prelude::Smoother;
+
+/// Above that level, the soft limiter starts to bend the signal towards 1.0
+const LIMITER_KNEE: f32 = 0.75;
+
+/// What is applied to the buffer after the DSP has run, in a single pass over
+/// each channel:
+///
+/// - the Gain parameter, computed block-wise (and skipped when it is constant
+///   and equal to 1.0)
+/// - NaN, infinite and denormal samples are replaced by 0, so that a DSP that
+///   blows up cannot poison the rest of the host's mix
+/// - an optional soft limiter, which needs no lookahead
+///
+/// The inner loops are branch-free so that they get auto-vectorized.
+pub(crate) struct OutputStage {
+    /// Pre-allocated so that the audio thread never allocates
+    gain_ramp: Vec<f32>,
+}
+
+impl OutputStage {
+    pub(crate) fn new(max_buffer_size: usize) -> Self {
+        Self {
+            gain_ramp: vec![1.0; max_buffer_size.max(1)],
+        }
+    }
+
+    pub(crate) fn process(&mut self, channels: &mut [&mut [f32]], gain: &Smoother<f32>, limit: bool) {
+        let num_samples = channels.first().map_or(0, |c| c.len());
+        // The host should never send more than max_buffer_size samples, but we
+        // still work by sub-blocks in case it does:
+        let mut start = 0;
+        while start < num_samples {
+            let len = (num_samples - start).min(self.gain_ramp.len());
+            let end = start + len;
+            if gain.is_smoothing() {
+                gain.next_block(&mut self.gain_ramp, len);
+                let ramp = &self.gain_ramp[..len];
+                for chan in channels.iter_mut() {
+                    if limit {
+                        process_chan::<true, true>(&mut chan[start..end], |i| ramp[i]);
+                    } else {
+                        process_chan::<true, false>(&mut chan[start..end], |i| ramp[i]);
+                    }
+                }
+            } else {
+                let g = gain.next();
+                for chan in channels.iter_mut() {
+                    let chan = &mut chan[start..end];
+                    match (g == 1.0, limit) {
+                        (true, true) => process_chan::<false, true>(chan, |_| g),
+                        (true, false) => process_chan::<false, false>(chan, |_| g),
+                        (false, true) => process_chan::<true, true>(chan, |_| g),
+                        (false, false) => process_chan::<true, false>(chan, |_| g),
+                    }
+                }
+            }
+            start = end;
+        }
+    }
+}
+
+/// `gain_at` is not called at all when GAIN is false
+#[inline(always)]
+fn process_chan<const GAIN: bool, const LIMIT: bool>(
+    samples: &mut [f32],
+    gain_at: impl Fn(usize) -> f32,
+) {
+    for (i, s) in samples.iter_mut().enumerate() {
+        let x = scrub(if GAIN { *s * gain_at(i) } else { *s });
+        *s = if LIMIT { soft_limit(x) } else { x };
+    }
+}
+
+#[inline(always)]
+fn scrub(x: f32) -> f32 {
+    // Both NaN and infinity fail the first comparison:
+    if x.abs() < f32::INFINITY && x.abs() >= f32::MIN_POSITIVE {
+        x
+    } else {
+        0.0
+    }
+}
+
+/// Identity below the knee. Above it, a rational curve which has the same slope
+/// at the knee, and tends towards 1.0 (0 dBFS)
+#[inline(always)]
+fn soft_limit(x: f32) -> f32 {
+    let a = x.abs();
+    let t = (a - LIMITER_KNEE) / (1.0 - LIMITER_KNEE);
+    let bent = LIMITER_KNEE + (1.0 - LIMITER_KNEE) * t / (1.0 + t);
+    if a > LIMITER_KNEE {
+        bent.copysign(x)
+    } else {
+        x
+    }
+}